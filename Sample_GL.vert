@@ -1,10 +1,18 @@
 #version 330 core
 
 // input data : sent from main program
-layout (location = 0) in vec3 vertexPosition;
+layout (location = 0) in vec3 vertexPosition; // float, half float or packed 10:10:10:2, converted by the vertex fetch
 layout (location = 1) in vec3 vertexColor;
+layout (location = 2) in int instanceId; // 0, 1, 2, .. per instance, plus the draw's base instance
 
-uniform mat4 MVP;
+// per-frame values, uploaded once a frame
+layout (std140) uniform Frame {
+    mat4 VP; // Projection * View
+};
+
+// every model matrix of the frame, 4 RGBA32F texels (columns) each
+uniform samplerBuffer Models;
+uniform int ModelBase; // the draw's instances take models ModelBase + instanceId
 
 // output data : used by fragment shader
 out vec3 fragColor;
@@ -17,6 +25,9 @@ void main ()
     // to produce the color of each fragment
     fragColor = vertexColor;
 
+    int m = (ModelBase + instanceId) * 4;
+    mat4 model = mat4(texelFetch(Models, m), texelFetch(Models, m+1), texelFetch(Models, m+2), texelFetch(Models, m+3));
+
     // Output position of the vertex, in clip space : MVP * position
-    gl_Position = MVP * v;
+    gl_Position = VP * model * v;
 }
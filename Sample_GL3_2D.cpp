@@ -2,10 +2,31 @@
 #include <cmath>
 #include <fstream>
 #include <vector>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <algorithm>
+#include <future>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <GL/glew.h>
 #include <GL/glu.h>
 #include <GL/freeglut.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
 
 #define GLM_FORCE_RADIANS
 #include <glm/glm.hpp>
@@ -13,18 +34,37 @@
 #include <glm/gtc/matrix_transform.hpp>
 #include <SFML/Audio.hpp>
 
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// last, X11 defines a lot of short macro names
+#include <GL/glx.h>
+
  #pragma comment(lib, "irrKlang.lib") // link with irrKlang.dll
 
 using namespace std;
 
+/* How a mesh's vertex positions are stored, the colour is always a normalized RGBA8 */
+enum VertexFormat {
+    VERTEX_FLOAT,  // 3 floats, 16 byte vertices
+    VERTEX_HALF,   // 3 half floats, 12 byte vertices
+    VERTEX_PACKED, // signed normalized 10:10:10:2 over the mesh's bounding box, 8 byte vertices
+    VERTEX_FORMATS
+};
+
 struct VAO {
     GLuint VertexArrayID;
-    GLuint VertexBuffer;
-    GLuint ColorBuffer;
+    GLint FirstVertex;     // where the mesh starts in the vertex arena, in vertices of its format
+    VertexFormat Format;
+    glm::vec3 PositionBias, PositionScale; // VERTEX_PACKED : the position is bias + scale * the stored -1..1
 
     GLenum PrimitiveMode;
     GLenum FillMode;
     int NumVertices;
+    GLint FirstIndex;      // indexed meshes : where their indices start in the arena's index buffer
+    int NumIndices;        // 0 : not indexed, drawn straight from the vertices
+    int MeshId;            // index in render_meshes, render queue keys refer to the mesh by it
 };
 typedef struct VAO VAO;
 
@@ -32,45 +72,146 @@ struct GLMatrices {
 	glm::mat4 projection;
 	glm::mat4 model;
 	glm::mat4 view;
-	GLuint MatrixID;
 } Matrices;
 
 GLuint programID;
+GLint ModelBaseID;   // "ModelBase" uniform, where the draw's model matrices start in the Models texture buffer
+GLint uniform_align; // GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT
+const GLuint frame_block_binding = 0; // uniform buffer binding point of the shader's "Frame" block
+
+// headless benchmark mode, see initHeadless() and runHeadless()
+bool headless = false;
+int bench_frames = 1000;
+GLuint headless_fbo;
+
+// submitted work of the current frame, reset at the start of draw()
+int frame_draw_calls = 0;
+long frame_triangles = 0;
+int frame_tiles_drawn = 0, frame_tiles_culled = 0, frame_tiles_hidden = 0; // culled : outside the frustum, hidden : blinked out in it
 
 sf::SoundBuffer buffer1;
 sf::Sound sound1;
 
-/* Function to load Shaders - Use it as it is */
-GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path) {
+/* Read a whole file with a single bulk read, empty if it can not be opened */
+std::string readFile (const char * file_path)
+{
+	std::string data;
+	std::ifstream stream(file_path, std::ios::in | std::ios::binary);
+	if(stream.is_open()){
+		stream.seekg(0, std::ios::end);
+		data.resize((size_t)stream.tellg());
+		stream.seekg(0, std::ios::beg);
+		if(!data.empty())
+			stream.read(&data[0], data.size());
+	}
+	return data;
+}
 
-	// Create the shaders
-	GLuint VertexShaderID = glCreateShader(GL_VERTEX_SHADER);
-	GLuint FragmentShaderID = glCreateShader(GL_FRAGMENT_SHADER);
+/* FNV-1a hash, 'hash' carries on from an earlier call */
+unsigned long long fnv1a (const std::string& data, unsigned long long hash = 14695981039346656037ULL)
+{
+	for (size_t k=0; k<data.size(); k++) {
+		hash ^= (unsigned char)data[k];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+/* Linked programs are cached here by glGetProgramBinary, see LoadShaders */
+const char * shader_cache_path = "Sample_GL.cache";
+const char shader_cache_magic[4] = { 'D', 'N', 'A', 'S' };
+
+/* Program binaries need GL 4.1 or ARB_get_program_binary, and at least one binary format */
+bool programBinarySupported ()
+{
+	if (!GLEW_VERSION_4_1 && !GLEW_ARB_get_program_binary)
+		return false;
+	GLint formats = 0;
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+	return formats > 0;
+}
+
+/* Program from the binary cache if it was saved under 'key', 0 otherwise */
+GLuint loadProgramBinary (unsigned long long key)
+{
+	std::string cache = readFile(shader_cache_path);
+	size_t header = sizeof(shader_cache_magic) + sizeof(key) + sizeof(GLenum) + sizeof(GLint);
+	if (cache.size() < header || memcmp(&cache[0], shader_cache_magic, sizeof(shader_cache_magic)) != 0)
+		return 0;
+
+	const char * p = &cache[sizeof(shader_cache_magic)];
+	unsigned long long cached_key;
+	GLenum format;
+	GLint length;
+	memcpy(&cached_key, p, sizeof(cached_key)); p += sizeof(cached_key);
+	memcpy(&format, p, sizeof(format)); p += sizeof(format);
+	memcpy(&length, p, sizeof(length)); p += sizeof(length);
+	if (cached_key != key || length <= 0 || cache.size() < header + length)
+		return 0;
+
+	GLuint ProgramID = glCreateProgram();
+	glProgramBinary(ProgramID, format, p, length);
 
-	// Read the Vertex Shader code from the file
-	std::string VertexShaderCode;
-	std::ifstream VertexShaderStream(vertex_file_path, std::ios::in);
-	if(VertexShaderStream.is_open())
-	{
-		std::string Line = "";
-		while(getline(VertexShaderStream, Line))
-			VertexShaderCode += "\n" + Line;
-		VertexShaderStream.close();
+	// the driver may still turn the binary down (e.g. after an update it does not advertise)
+	GLint Result = GL_FALSE;
+	glGetProgramiv(ProgramID, GL_LINK_STATUS, &Result);
+	if (Result != GL_TRUE) {
+		glDeleteProgram(ProgramID);
+		return 0;
 	}
+	return ProgramID;
+}
+
+/* Write the linked program to the binary cache under 'key' */
+void saveProgramBinary (GLuint ProgramID, unsigned long long key)
+{
+	GLint length = 0;
+	glGetProgramiv(ProgramID, GL_PROGRAM_BINARY_LENGTH, &length);
+	if (length <= 0)
+		return;
+
+	std::vector<char> binary(length);
+	GLenum format;
+	glGetProgramBinary(ProgramID, length, &length, &format, &binary[0]);
+
+	std::ofstream stream(shader_cache_path, std::ios::out | std::ios::binary | std::ios::trunc);
+	if (!stream.is_open())
+		return;
+	stream.write(shader_cache_magic, sizeof(shader_cache_magic));
+	stream.write((const char*)&key, sizeof(key));
+	stream.write((const char*)&format, sizeof(format));
+	stream.write((const char*)&length, sizeof(length));
+	stream.write(&binary[0], length);
+}
 
-	// Read the Fragment Shader code from the file
-	std::string FragmentShaderCode;
-	std::ifstream FragmentShaderStream(fragment_file_path, std::ios::in);
-	if(FragmentShaderStream.is_open()){
-		std::string Line = "";
-		while(getline(FragmentShaderStream, Line))
-			FragmentShaderCode += "\n" + Line;
-		FragmentShaderStream.close();
+/* Function to load Shaders - Use it as it is */
+/* The linked program is cached on disk, keyed by the shader sources and the GL vendor,
+   renderer and version. Later launches load it from there and only compile when the key changes */
+GLuint LoadShaders(const char * vertex_file_path, const std::string& VertexShaderCode, const char * fragment_file_path, const std::string& FragmentShaderCode) {
+
+	// Try the binary cache first
+	bool binary_cache = programBinarySupported();
+	unsigned long long key = 0;
+	if (binary_cache) {
+		key = fnv1a(VertexShaderCode);
+		key = fnv1a(std::string(1, '\0') + FragmentShaderCode, key);
+		key = fnv1a(std::string(1, '\0') + (const char*)glGetString(GL_VENDOR), key);
+		key = fnv1a(std::string(1, '\0') + (const char*)glGetString(GL_RENDERER), key);
+		key = fnv1a(std::string(1, '\0') + (const char*)glGetString(GL_VERSION), key);
+
+		GLuint ProgramID = loadProgramBinary(key);
+		if (ProgramID) {
+			printf("Loaded program from %s\n", shader_cache_path);
+			return ProgramID;
+		}
 	}
 
+	// Create the shaders
+	GLuint VertexShaderID = glCreateShader(GL_VERTEX_SHADER);
+	GLuint FragmentShaderID = glCreateShader(GL_FRAGMENT_SHADER);
+
 	GLint Result = GL_FALSE;
 	int InfoLogLength;
-
 	// Compile Vertex Shader
 	printf("Compiling shader : %s\n", vertex_file_path);
 	char const * VertexSourcePointer = VertexShaderCode.c_str();
@@ -102,6 +243,8 @@ GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path
 	GLuint ProgramID = glCreateProgram();
 	glAttachShader(ProgramID, VertexShaderID);
 	glAttachShader(ProgramID, FragmentShaderID);
+	if (binary_cache)
+		glProgramParameteri(ProgramID, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
 	glLinkProgram(ProgramID);
 
 	// Check the program
@@ -114,90 +257,800 @@ GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path
 	glDeleteShader(VertexShaderID);
 	glDeleteShader(FragmentShaderID);
 
+	if (binary_cache && Result == GL_TRUE)
+		saveProgramBinary(ProgramID, key);
+
 	return ProgramID;
 }
 
-/* Generate VAO, VBOs and return VAO handle */
-struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* color_buffer_data, GLenum fill_mode=GL_FILL)
+/* Same, reading the shader code from the files */
+GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path) {
+	return LoadShaders(vertex_file_path, readFile(vertex_file_path), fragment_file_path, readFile(fragment_file_path));
+}
+
+/* Wall clock time in seconds, from a monotonic clock */
+double elapsed_seconds ()
+{
+    static const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+/* Work-stealing job system for the per-tile loops. Every thread has its own deque of index ranges,
+   it takes work from the back of its own and steals from the front of the others when it runs dry.
+   A range bigger than its grain is split and the upper half pushed for others to take, so a
+   parallel_for starts as one job and spreads out as the workers steal. Splits fall on job_align
+   boundaries, 16 floats = one cache line, so no two threads write the same line of the 64-byte
+   aligned tile arrays and the SIMD kernels keep their aligned loads */
+const int job_align = 16;
+const int max_job_callers = 4; // threads outside the pool that call parallel_for (simulation, render)
+
+struct Job {
+    const std::function<void(int,int)>* fn;
+    int begin, end, grain;
+    std::atomic<int>* remaining; // indices of the parallel_for not done yet
+};
+
+struct JobQueue {
+    std::mutex mutex;
+    std::deque<Job> jobs;
+};
+
+struct JobSystem {
+    vector<std::thread> workers;
+    JobQueue* queues;            // one per worker, then one per caller
+    int num_queues;
+    std::atomic<int> next_caller;
+    std::atomic<int> queued;     // jobs waiting in any deque
+    std::atomic<bool> stop;
+    std::mutex sleep_mutex;
+    std::condition_variable wake;
+} jobs;
+
+thread_local int job_queue = -1; // this thread's deque
+
+void pushJob (int q, const Job& job)
+{
+    {
+        std::lock_guard<std::mutex> lock(jobs.queues[q].mutex);
+        jobs.queues[q].jobs.push_back(job);
+    }
+    jobs.queued++;
+    { std::lock_guard<std::mutex> lock(jobs.sleep_mutex); } // a worker between its check and its wait still sees it
+    jobs.wake.notify_one();
+}
+
+/* Newest job of our own deque (back) or oldest of someone else's (front) */
+bool popJob (int q, Job& job, bool own)
+{
+    std::lock_guard<std::mutex> lock(jobs.queues[q].mutex);
+    std::deque<Job>& d = jobs.queues[q].jobs;
+    if (d.empty())
+        return false;
+    if (own) {
+        job = d.back();
+        d.pop_back();
+    }
+    else {
+        job = d.front();
+        d.pop_front();
+    }
+    jobs.queued--;
+    return true;
+}
+
+bool findJob (int self, Job& job)
+{
+    if (popJob(self, job, true))
+        return true;
+    for (int k=1; k<jobs.num_queues; k++)
+        if (popJob((self+k) % jobs.num_queues, job, false))
+            return true;
+    return false;
+}
+
+void runJob (int self, Job job)
+{
+    // hand the upper half out until what is left is one grain
+    while (job.end - job.begin > job.grain) {
+        int half = ((job.end - job.begin)/2 + job_align-1) / job_align * job_align;
+        Job upper = job;
+        upper.begin = job.begin + half;
+        pushJob(self, upper);
+        job.end = upper.begin;
+    }
+    (*job.fn)(job.begin, job.end);
+    *job.remaining -= job.end - job.begin; // the job's last touch of the caller's stack
+}
+
+void workerLoop (int self)
+{
+    job_queue = self;
+    Job job;
+    while (!jobs.stop) {
+        if (findJob(self, job)) {
+            runJob(self, job);
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(jobs.sleep_mutex);
+        jobs.wake.wait(lock, [] { return jobs.queued > 0 || jobs.stop; });
+    }
+}
+
+/* Run fn(b, e) over sub-ranges covering [begin, end), returns when all are done. 'begin' has to be
+   0 or a multiple of job_align; ranges up to 'grain' run on the calling thread */
+void parallel_for (int begin, int end, int grain, const std::function<void(int,int)>& fn)
+{
+    grain = max(job_align, (grain + job_align-1) / job_align * job_align);
+    if (end - begin <= grain || jobs.workers.empty()) {
+        fn(begin, end);
+        return;
+    }
+    if (job_queue < 0) {
+        int caller = jobs.next_caller++;
+        if (caller >= max_job_callers) {
+            fn(begin, end);
+            return;
+        }
+        job_queue = jobs.workers.size() + caller;
+    }
+
+    std::atomic<int> remaining(end - begin);
+    Job job = { &fn, begin, end, grain, &remaining };
+    runJob(job_queue, job);
+
+    // help until every index is done, whatever job that takes
+    Job other;
+    while (remaining > 0) {
+        if (findJob(job_queue, other))
+            runJob(job_queue, other);
+        else
+            std::this_thread::yield();
+    }
+}
+
+void stopJobs ()
+{
+    {
+        std::lock_guard<std::mutex> lock(jobs.sleep_mutex);
+        jobs.stop = true;
+    }
+    jobs.wake.notify_all();
+    for (size_t k=0; k<jobs.workers.size(); k++)
+        jobs.workers[k].join();
+    jobs.workers.clear();
+}
+
+/* Start 'count' workers, 0 keeps every loop on its calling thread */
+void startJobs (int count)
+{
+    jobs.num_queues = count + max_job_callers;
+    jobs.queues = new JobQueue[jobs.num_queues];
+    for (int k=0; k<count; k++)
+        jobs.workers.push_back(std::thread(workerLoop, k));
+    atexit (stopJobs);
+}
+
+/* Shadow copy of the GL state the draw calls touch, so calls that would not change
+   anything never reach the driver. Enabled attributes are VAO state, so they are kept per VAO */
+struct GLStateCache {
+    GLuint program;
+    GLuint vertex_array;
+    GLuint array_buffer;
+    GLenum polygon_mode;
+    GLint model_base;                 // "ModelBase" uniform of programID
+    vector<unsigned> enabled_attribs; // bit i set: attribute i is enabled, indexed by VAO name
+} glstate = { ~0u, ~0u, ~0u, GL_NONE, -1, vector<unsigned>() };
+int frame_redundant_calls = 0; // debug counter : calls skipped this frame
+
+void useProgram (GLuint program)
+{
+    if (glstate.program == program) {
+        frame_redundant_calls++;
+        return;
+    }
+    glstate.program = program;
+    glUseProgram (program);
+}
+
+void bindVertexArray (GLuint vertex_array)
+{
+    if (glstate.vertex_array == vertex_array) {
+        frame_redundant_calls++;
+        return;
+    }
+    glstate.vertex_array = vertex_array;
+    glBindVertexArray (vertex_array);
+}
+
+void bindArrayBuffer (GLuint buffer)
+{
+    if (glstate.array_buffer == buffer) {
+        frame_redundant_calls++;
+        return;
+    }
+    glstate.array_buffer = buffer;
+    glBindBuffer (GL_ARRAY_BUFFER, buffer);
+}
+
+void setPolygonMode (GLenum mode)
+{
+    if (glstate.polygon_mode == mode) {
+        frame_redundant_calls++;
+        return;
+    }
+    glstate.polygon_mode = mode;
+    glPolygonMode (GL_FRONT_AND_BACK, mode);
+}
+
+/* Point the bound program's ModelBase uniform at model matrix 'base' */
+void setModelBase (GLint base)
+{
+    if (glstate.model_base == base) {
+        frame_redundant_calls++;
+        return;
+    }
+    glstate.model_base = base;
+    glUniform1i (ModelBaseID, base);
+}
+
+/* Enable attribute 'index' of the bound VAO */
+void enableAttrib (GLuint index)
 {
+    if (glstate.vertex_array >= glstate.enabled_attribs.size())
+        glstate.enabled_attribs.resize(glstate.vertex_array + 1, 0);
+    unsigned& enabled = glstate.enabled_attribs[glstate.vertex_array];
+    if (enabled & (1u << index)) {
+        frame_redundant_calls++;
+        return;
+    }
+    enabled |= 1u << index;
+    glEnableVertexAttribArray (index);
+}
+
+/* Interleaved vertex, meshes are built with it and stored in their VertexFormat */
+struct Vertex {
+    GLfloat x, y, z;
+    GLubyte color[4];
+};
+
+struct HalfVertex {
+    GLhalf x, y, z, pad;
+    GLubyte color[4];
+};
+
+struct PackedVertex {
+    GLuint xyz; // x in bits 0-9, y 10-19, z 20-29 (GL_INT_2_10_10_10_REV)
+    GLubyte color[4];
+};
+
+const GLsizei vertex_stride[VERTEX_FORMATS] = { sizeof(Vertex), sizeof(HalfVertex), sizeof(PackedVertex) };
+
+/* One static vertex buffer shared by every mesh, with a VAO per format over all of it */
+struct VertexArena {
+    GLuint VertexArrayID[VERTEX_FORMATS];
+    GLuint Buffer;
+    GLsizeiptr capacity, used; // in bytes
+    GLuint Indices;     // 16-bit indices of the indexed meshes, relative to their FirstVertex
+    int index_capacity, indices_used;
+    GLuint InstanceIds; // 0, 1, 2, .. : attribute 2, one per instance, offset by the draw's base instance
+    int instance_ids;
+} arena;
+vector<VAO*> render_meshes; // every mesh, by MeshId
+
+/* Per-frame data goes through a ring of frames_in_flight regions, persistently mapped when it can be */
+const int frames_in_flight = 3;
+struct StreamRing {
+    GLuint Buffer;
+    GLubyte* mapped;
+    vector<GLubyte> staging; // without a mapping, ring_commit() uploads from here
+    GLsizeiptr region_size;
+    int region;
+    GLsizeiptr used;    // bytes taken from the current region
+    GLsync fences[frames_in_flight];
+    GLuint Texture;     // RGBA32F texture buffer over the whole ring, model matrices are fetched through it
+    GLsizeiptr max_size; // the most the texture buffer can address, the ring never grows past it
+} ring;
+
+/* Point the bound VAO's attributes at the arena, read as 'format', and at the instance ids */
+void setVertexFormat (VertexFormat format)
+{
+    bindArrayBuffer (arena.Buffer);
+    enableAttrib(0);
+    enableAttrib(1);
+    if (format == VERTEX_FLOAT) {
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, x));
+        glVertexAttribPointer(1, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(Vertex), (void*)offsetof(Vertex, color));
+    }
+    else if (format == VERTEX_HALF) {
+        glVertexAttribPointer(0, 3, GL_HALF_FLOAT, GL_FALSE, sizeof(HalfVertex), (void*)offsetof(HalfVertex, x));
+        glVertexAttribPointer(1, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(HalfVertex), (void*)offsetof(HalfVertex, color));
+    }
+    else {
+        // the packed type only comes with 4 components, the vec3 input drops w
+        glVertexAttribPointer(0, 4, GL_INT_2_10_10_10_REV, GL_TRUE, sizeof(PackedVertex), (void*)offsetof(PackedVertex, xyz));
+        glVertexAttribPointer(1, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(PackedVertex), (void*)offsetof(PackedVertex, color));
+    }
+    bindArrayBuffer (arena.InstanceIds);
+    enableAttrib(2);
+    glVertexAttribIPointer(2, 1, GL_INT, sizeof(GLint), (void*)0);
+    glVertexAttribDivisor(2, 1);
+}
+
+/* Make the instance ids go up to at least n-1 */
+void reserveInstanceIds (int n)
+{
+    if (n <= arena.instance_ids)
+        return;
+    arena.instance_ids = max(n, 2*arena.instance_ids);
+    vector<GLint> ids(arena.instance_ids);
+    for (int i=0; i<arena.instance_ids; i++)
+        ids[i] = i;
+    bindArrayBuffer (arena.InstanceIds);
+    glBufferData (GL_ARRAY_BUFFER, ids.size()*sizeof(GLint), &ids[0], GL_STATIC_DRAW); // the VAO keeps pointing at the buffer
+}
+
+/* Allocate the vertex arena, room for 'capacity' float vertices and as many indices */
+void initVertexArena (int capacity)
+{
+    arena.capacity = capacity*sizeof(Vertex);
+    arena.used = 0;
+    glGenBuffers (1, &arena.Buffer);
+    bindArrayBuffer (arena.Buffer);
+    glBufferData (GL_ARRAY_BUFFER, arena.capacity, NULL, GL_STATIC_DRAW);
+    glGenBuffers (1, &arena.InstanceIds);
+    reserveInstanceIds (1024);
+
+    arena.index_capacity = capacity;
+    arena.indices_used = 0;
+    glGenBuffers (1, &arena.Indices);
+    for (int f=0; f<VERTEX_FORMATS; f++) {
+        glGenVertexArrays (1, &arena.VertexArrayID[f]);
+        bindVertexArray (arena.VertexArrayID[f]);
+        setVertexFormat((VertexFormat)f);
+        glBindBuffer (GL_ELEMENT_ARRAY_BUFFER, arena.Indices); // every format draws from the one index buffer
+    }
+    glBufferData (GL_ELEMENT_ARRAY_BUFFER, arena.index_capacity*sizeof(GLushort), NULL, GL_STATIC_DRAW);
+}
+
+/* (Re)create the stream ring with regions of at least 'region_size' bytes */
+void initStreamRing (GLsizeiptr region_size)
+{
+    if (ring.Buffer) {
+        glFinish(); // nothing may still read the old buffer
+        glDeleteBuffers (1, &ring.Buffer);
+        if (glstate.array_buffer == ring.Buffer)
+            glstate.array_buffer = 0; // deleting a bound buffer unbinds it
+        for (int f=0; f<frames_in_flight; f++)
+            if (ring.fences[f])
+                glDeleteSync(ring.fences[f]);
+    }
+    ring.region_size = region_size;
+    ring.region = 0;
+    ring.used = 0;
+    ring.mapped = NULL;
+    for (int f=0; f<frames_in_flight; f++)
+        ring.fences[f] = 0;
+
+    glGenBuffers (1, &ring.Buffer);
+    bindArrayBuffer (ring.Buffer);
+    GLsizeiptr size = region_size*frames_in_flight;
+    if (GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage) {
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glBufferStorage (GL_ARRAY_BUFFER, size, NULL, flags);
+        ring.mapped = (GLubyte*) glMapBufferRange (GL_ARRAY_BUFFER, 0, size, flags);
+    }
+    else {
+        glBufferData (GL_ARRAY_BUFFER, size, NULL, GL_STREAM_DRAW);
+        ring.staging.resize(region_size);
+    }
+
+    // the only texture there is, it stays bound on unit 0
+    if (!ring.Texture)
+        glGenTextures (1, &ring.Texture);
+    glBindTexture (GL_TEXTURE_BUFFER, ring.Texture);
+    glTexBuffer (GL_TEXTURE_BUFFER, GL_RGBA32F, ring.Buffer);
+}
+
+/* Largest region the model texture buffer can address in every region of the ring */
+GLsizeiptr ringMaxRegion ()
+{
+    if (!ring.max_size) {
+        GLint max_texels = 0;
+        glGetIntegerv (GL_MAX_TEXTURE_BUFFER_SIZE, &max_texels);
+        ring.max_size = (GLsizeiptr)max_texels*16;
+    }
+    return ring.max_size/frames_in_flight/64*64;
+}
+
+/* Start again with regions of at least 'needed' bytes (twice the old ones), up to ringMaxRegion() */
+void growStreamRing (GLsizeiptr needed)
+{
+    initStreamRing (min(max(2*ring.region_size, needed), ringMaxRegion()));
+}
+
+void ring_end_frame ();
+
+/* Make room for 'bytes' more this frame, true if that left earlier allocations behind */
+bool ring_reserve (GLsizeiptr bytes)
+{
+    if (ring.used + bytes <= ring.region_size)
+        return false;
+    if (ring.region_size < ringMaxRegion()) {
+        growStreamRing (ring.used + bytes);
+        ring.used = 0;
+    }
+    else
+        ring_end_frame ();
+    return true;
+}
+
+/* Take 'bytes' from this frame's region at a multiple of 64 and of 'align', returns where to write them */
+void* ring_alloc (GLsizeiptr bytes, GLintptr* offset, GLintptr align = 64)
+{
+    bytes = (bytes + 63) / 64 * 64;
+    GLintptr start = ring.region*ring.region_size + ring.used;
+    ring.used += (align - start % align) % align;
+    if (ring.used + bytes > ring.region_size) {
+        ring_reserve (bytes + align);
+        ring.used = (align - ring.region*ring.region_size % align) % align;
+    }
+    *offset = ring.region*ring.region_size + ring.used;
+    void* ptr = ring.mapped ? (void*)(ring.mapped + *offset) : (void*)(&ring.staging[0] + ring.used);
+    ring.used += bytes;
+    return ptr;
+}
+
+/* Make data written through ring_alloc visible to the GPU (the mapping is coherent, nothing to do then) */
+void ring_commit (GLintptr offset, const void* data, GLsizeiptr bytes)
+{
+    if (ring.mapped)
+        return;
+    bindArrayBuffer (ring.Buffer);
+    glBufferSubData (GL_ARRAY_BUFFER, offset, bytes, data);
+}
+
+/* Fence the region used this frame and move on to the next one, waiting if the GPU still reads it */
+void ring_end_frame ()
+{
+    if (ring.fences[ring.region])
+        glDeleteSync(ring.fences[ring.region]);
+    ring.fences[ring.region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+    ring.region = (ring.region + 1) % frames_in_flight;
+    ring.used = 0;
+    GLsync fence = ring.fences[ring.region];
+    if (fence) {
+        while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED)
+            ;
+        glDeleteSync(fence);
+        ring.fences[ring.region] = 0;
+    }
+}
+
+/* Round to the nearest half float. Too small values flush to zero, too big ones become infinity */
+GLhalf packHalf (GLfloat f)
+{
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    uint32_t sign = (bits >> 16) & 0x8000, mantissa = bits & 0x7fffff;
+    int exponent = (int)((bits >> 23) & 0xff) - 127 + 15;
+    if (exponent <= 0)
+        return sign;
+    if (exponent >= 31)
+        return sign | 0x7c00;
+    // rounding up may carry into the exponent, which is still the right value
+    return (sign | exponent << 10 | mantissa >> 13) + ((mantissa >> 12) & 1);
+}
+
+/* A -1..1 value as a 10 bit signed normalized field */
+GLuint packSnorm10 (GLfloat v)
+{
+    if (v <= -1.0f)
+        return 0x200; // -512, -1 under both the GL 3.3 and the GL 4.2 rule
+    int q = (int)lround(min(v, 1.0f) * 511.0f);
+    return (GLuint)q & 0x3ff;
+}
+
+/* 'vertices' stored as 'format', VERTEX_PACKED maps the bounding box to -1..1 and keeps the mapping in vao */
+vector<GLubyte> encodeVertices (const vector<Vertex>& vertices, VertexFormat format, VAO* vao)
+{
+    int numVertices = vertices.size();
+    vao->PositionBias = glm::vec3(0, 0, 0);
+    vao->PositionScale = glm::vec3(1, 1, 1);
+    vector<GLubyte> bytes(numVertices*vertex_stride[format]);
+    if (format == VERTEX_FLOAT) {
+        memcpy(&bytes[0], &vertices[0], bytes.size());
+    }
+    else if (format == VERTEX_HALF) {
+        HalfVertex* out = (HalfVertex*)&bytes[0];
+        for (int i=0; i<numVertices; i++) {
+            out[i].x = packHalf(vertices[i].x);
+            out[i].y = packHalf(vertices[i].y);
+            out[i].z = packHalf(vertices[i].z);
+            out[i].pad = 0;
+            memcpy(out[i].color, vertices[i].color, 4);
+        }
+    }
+    else {
+        float bias[3], scale[3], lo[3], hi[3];
+        for (int c=0; c<3; c++) {
+            lo[c] = hi[c] = (&vertices[0].x)[c];
+            for (int i=1; i<numVertices; i++) {
+                lo[c] = min(lo[c], (&vertices[i].x)[c]);
+                hi[c] = max(hi[c], (&vertices[i].x)[c]);
+            }
+            // a flat axis is stored as its -1 end, 0 isn't exact under GL 3.3's conversion
+            scale[c] = hi[c] > lo[c] ? (hi[c] - lo[c])/2 : 1;
+            bias[c] = lo[c] + scale[c];
+        }
+        vao->PositionBias = glm::vec3(bias[0], bias[1], bias[2]);
+        vao->PositionScale = glm::vec3(scale[0], scale[1], scale[2]);
+        PackedVertex* out = (PackedVertex*)&bytes[0];
+        for (int i=0; i<numVertices; i++) {
+            out[i].xyz = 0;
+            for (int c=0; c<3; c++) {
+                // the ends straight to -1 and 1, (lo - bias)/scale may round off them
+                float p = (&vertices[i].x)[c];
+                float n = p == lo[c] ? -1.0f : p == hi[c] ? 1.0f : (p - bias[c])/scale[c];
+                out[i].xyz |= packSnorm10(n) << 10*c;
+            }
+            memcpy(out[i].color, vertices[i].color, 4);
+        }
+    }
+    return bytes;
+}
+
+/* Copy the mesh into the vertex arena, stored as 'format', and return VAO handle */
+struct VAO* create3DObject (GLenum primitive_mode, const vector<Vertex>& vertices, GLenum fill_mode=GL_FILL, VertexFormat format=VERTEX_FLOAT)
+{
+    int numVertices = vertices.size();
+    GLsizei stride = vertex_stride[format];
+    GLsizeiptr start = (arena.used + stride-1)/stride*stride; // a whole number of vertices of the format in
+    if (start + numVertices*stride > arena.capacity) {
+        cout << "Error: Vertex arena is full (" << arena.capacity << " bytes)" << endl;
+        exit (1);
+    }
+
     struct VAO* vao = new struct VAO;
     vao->PrimitiveMode = primitive_mode;
     vao->NumVertices = numVertices;
     vao->FillMode = fill_mode;
-
-    // Create Vertex Array Object
-    glGenVertexArrays(1, &(vao->VertexArrayID)); // VAO
-    glGenBuffers (1, &(vao->VertexBuffer)); // VBO - vertices
-    glGenBuffers (1, &(vao->ColorBuffer));  // VBO - colors
-
-    glBindVertexArray (vao->VertexArrayID); // Bind the VAO
-    glBindBuffer (GL_ARRAY_BUFFER, vao->VertexBuffer); // Bind the VBO vertices
-    glBufferData (GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), vertex_buffer_data, GL_STATIC_DRAW); // Copy the vertices into VBO
-    glVertexAttribPointer(
-                          0,                  // attribute 0. Vertices
-                          3,                  // size (x,y,z)
-                          GL_FLOAT,           // type
-                          GL_FALSE,           // normalized?
-                          0,                  // stride
-                          (void*)0            // array buffer offset
-                          );
-
-    glBindBuffer (GL_ARRAY_BUFFER, vao->ColorBuffer); // Bind the VBO colors
-    glBufferData (GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), color_buffer_data, GL_STATIC_DRAW);  // Copy the vertex colors
-    glVertexAttribPointer(
-                          1,                  // attribute 1. Color
-                          3,                  // size (r,g,b)
-                          GL_FLOAT,           // type
-                          GL_FALSE,           // normalized?
-                          0,                  // stride
-                          (void*)0            // array buffer offset
-                          );
+    vao->Format = format;
+    vao->VertexArrayID = arena.VertexArrayID[format];
+    vao->FirstVertex = start/stride;
+    vao->FirstIndex = 0;
+    vao->NumIndices = 0;
+    vao->MeshId = render_meshes.size();
+    render_meshes.push_back(vao);
+
+    vector<GLubyte> bytes = encodeVertices(vertices, format, vao);
+    bindArrayBuffer (arena.Buffer);
+    glBufferSubData (GL_ARRAY_BUFFER, start, bytes.size(), &bytes[0]);
+    arena.used = start + bytes.size();
 
     return vao;
 }
 
-/* Generate VAO, VBOs and return VAO handle - Common Color for all vertices */
+/* Pack a 0..1 colour channel into a normalized byte */
+GLubyte packColor (GLfloat c)
+{
+    return (GLubyte) (min(max(c, 0.0f), 1.0f)*255.0f + 0.5f);
+}
+
+/* Interleave separate position and colour arrays */
+vector<Vertex> interleave (int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* color_buffer_data)
+{
+    vector<Vertex> vertices(numVertices);
+    for (int i=0; i<numVertices; i++) {
+        vertices[i].x = vertex_buffer_data[3*i];
+        vertices[i].y = vertex_buffer_data[3*i + 1];
+        vertices[i].z = vertex_buffer_data[3*i + 2];
+        vertices[i].color[0] = packColor(color_buffer_data[3*i]);
+        vertices[i].color[1] = packColor(color_buffer_data[3*i + 1]);
+        vertices[i].color[2] = packColor(color_buffer_data[3*i + 2]);
+        vertices[i].color[3] = 255;
+    }
+    return vertices;
+}
+
+/* Generate VAO and return VAO handle - separate position and colour arrays */
+struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* color_buffer_data, GLenum fill_mode=GL_FILL)
+{
+    return create3DObject(primitive_mode, interleave(numVertices, vertex_buffer_data, color_buffer_data), fill_mode);
+}
+
+/* Generate VAO and return VAO handle - Common Color for all vertices */
 struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat red, const GLfloat green, const GLfloat blue, GLenum fill_mode=GL_FILL)
 {
-    GLfloat* color_buffer_data = new GLfloat [3*numVertices];
+    vector<Vertex> vertices(numVertices);
     for (int i=0; i<numVertices; i++) {
-        color_buffer_data [3*i] = red;
-        color_buffer_data [3*i + 1] = green;
-        color_buffer_data [3*i + 2] = blue;
+        vertices[i].x = vertex_buffer_data[3*i];
+        vertices[i].y = vertex_buffer_data[3*i + 1];
+        vertices[i].z = vertex_buffer_data[3*i + 2];
+        vertices[i].color[0] = packColor(red);
+        vertices[i].color[1] = packColor(green);
+        vertices[i].color[2] = packColor(blue);
+        vertices[i].color[3] = 255;
     }
+    return create3DObject(primitive_mode, vertices, fill_mode);
+}
+
+/* Indexed triangle list, the form the static meshes are uploaded in */
+struct IndexedMesh {
+    vector<Vertex> vertices;
+    vector<GLushort> indices;
+};
+
+const int vertex_cache_size = 32; // post-transform cache modelled by optimizeVertexCache
 
-    return create3DObject(primitive_mode, numVertices, vertex_buffer_data, color_buffer_data, fill_mode);
+/* Forsyth's vertex score, high for vertices in the cache and for those with few triangles left */
+float vertexCacheScore (int cache_position, int triangles_left)
+{
+    if (triangles_left == 0)
+        return -1;
+    float score = 0;
+    if (cache_position >= 3)
+        score = pow(1.0f - (cache_position-3)/(float)(vertex_cache_size-3), 1.5f);
+    else if (cache_position >= 0)
+        score = 0.75f;
+    return score + 2.0f/sqrt((float)triangles_left);
 }
 
-/* Render the VBOs handled by VAO */
-void draw3DObject (struct VAO* vao)
+/* Reorder the triangles for the post-transform cache (Forsyth), then the vertices by first use */
+void optimizeVertexCache (IndexedMesh& mesh)
 {
-    // Change the Fill Mode for this object
-    glPolygonMode (GL_FRONT_AND_BACK, vao->FillMode);
+    int nv = mesh.vertices.size(), nt = mesh.indices.size()/3;
+    vector<int> triangles_left(nv, 0), cache_position(nv, -1);
+    vector<vector<int> > triangles_of(nv);
+    for (int t=0; t<nt; t++)
+        for (int c=0; c<3; c++) {
+            triangles_left[mesh.indices[3*t+c]]++;
+            triangles_of[mesh.indices[3*t+c]].push_back(t);
+        }
 
-    // Bind the VAO to use
-    glBindVertexArray (vao->VertexArrayID);
+    vector<bool> emitted(nt, false);
+    vector<int> cache;
+    vector<GLushort> order;
+    order.reserve(mesh.indices.size());
+    for (int n=0; n<nt; n++) {
+        // the best triangle of those touching the cache, any best triangle when none does
+        int best = -1;
+        float best_score = -1;
+        auto consider = [&](int t) {
+            if (emitted[t])
+                return;
+            float score = 0;
+            for (int c=0; c<3; c++) {
+                int v = mesh.indices[3*t+c];
+                score += vertexCacheScore(cache_position[v], triangles_left[v]);
+            }
+            if (score > best_score) {
+                best_score = score;
+                best = t;
+            }
+        };
+        for (size_t k=0; k<cache.size(); k++)
+            for (size_t j=0; j<triangles_of[cache[k]].size(); j++)
+                consider(triangles_of[cache[k]][j]);
+        if (best < 0)
+            for (int t=0; t<nt; t++)
+                consider(t);
+
+        emitted[best] = true;
+        for (int c=0; c<3; c++) {
+            int v = mesh.indices[3*best+c];
+            order.push_back(v);
+            triangles_left[v]--;
+            cache.erase(std::remove(cache.begin(), cache.end(), v), cache.end());
+            cache.insert(cache.begin(), v);
+        }
+        if ((int)cache.size() > vertex_cache_size) {
+            for (size_t k=vertex_cache_size; k<cache.size(); k++)
+                cache_position[cache[k]] = -1;
+            cache.resize(vertex_cache_size);
+        }
+        for (size_t k=0; k<cache.size(); k++)
+            cache_position[cache[k]] = k;
+    }
 
-    // Enable Vertex Attribute 0 - 3d Vertices
-    glEnableVertexAttribArray(0);
-    // Bind the VBO to use
-    glBindBuffer(GL_ARRAY_BUFFER, vao->VertexBuffer);
+    // vertices in first use order, the vertex fetches then walk the buffer forwards
+    vector<int> remap(nv, -1);
+    vector<Vertex> vertices;
+    vertices.reserve(nv);
+    for (size_t i=0; i<order.size(); i++) {
+        if (remap[order[i]] < 0) {
+            remap[order[i]] = vertices.size();
+            vertices.push_back(mesh.vertices[order[i]]);
+        }
+        order[i] = remap[order[i]];
+    }
+    mesh.vertices.swap(vertices);
+    mesh.indices.swap(order);
+}
 
-    // Enable Vertex Attribute 1 - Color
-    glEnableVertexAttribArray(1);
-    // Bind the VBO to use
-    glBindBuffer(GL_ARRAY_BUFFER, vao->ColorBuffer);
+/* Index triangle list 'triangles' : identical vertices (position and colour) are stored once */
+IndexedMesh indexMesh (const vector<Vertex>& triangles)
+{
+    IndexedMesh mesh;
+    std::map<std::string, GLushort> index_of;
+    mesh.indices.reserve(triangles.size());
+    for (size_t i=0; i<triangles.size(); i++) {
+        std::string bytes((const char*)&triangles[i], sizeof(Vertex));
+        std::map<std::string, GLushort>::iterator it = index_of.find(bytes);
+        if (it == index_of.end()) {
+            if (mesh.vertices.size() > 0xffff) {
+                cout << "Error: Mesh has more than 65536 distinct vertices" << endl;
+                exit (1);
+            }
+            it = index_of.insert(std::make_pair(bytes, (GLushort)mesh.vertices.size())).first;
+            mesh.vertices.push_back(triangles[i]);
+        }
+        mesh.indices.push_back(it->second);
+    }
+    optimizeVertexCache(mesh);
+    return mesh;
+}
 
-    // Draw the geometry !
-    glDrawArrays(vao->PrimitiveMode, 0, vao->NumVertices); // Starting from vertex 0; 3 vertices total -> 1 triangle
+/* Generate VAO and return VAO handle - indexed mesh, the indices go to the arena's index buffer */
+struct VAO* create3DObject (GLenum primitive_mode, const IndexedMesh& mesh, GLenum fill_mode=GL_FILL, VertexFormat format=VERTEX_FLOAT)
+{
+    if (arena.indices_used + (int)mesh.indices.size() > arena.index_capacity) {
+        cout << "Error: Vertex arena is full (" << arena.index_capacity << " indices)" << endl;
+        exit (1);
+    }
+    struct VAO* vao = create3DObject(primitive_mode, mesh.vertices, fill_mode, format);
+    vao->FirstIndex = arena.indices_used;
+    vao->NumIndices = mesh.indices.size();
+
+    bindVertexArray (vao->VertexArrayID); // the element array binding is VAO state
+    glBufferSubData (GL_ELEMENT_ARRAY_BUFFER, arena.indices_used*sizeof(GLushort), mesh.indices.size()*sizeof(GLushort), &mesh.indices[0]);
+    arena.indices_used += mesh.indices.size();
+    return vao;
 }
 
+/* Triangles in one instance of vao */
+long meshTriangles (const VAO* vao)
+{
+    return (vao->NumIndices ? vao->NumIndices : vao->NumVertices)/3;
+}
+
+/* Upload the per-frame uniforms to the ring and bind them as the shader's "Frame" block */
+void bindFrameBlock (const glm::mat4& VP)
+{
+    GLintptr offset;
+    void* dst = ring_alloc(sizeof(glm::mat4), &offset, uniform_align);
+    memcpy(dst, &VP[0][0], sizeof(glm::mat4));
+    ring_commit(offset, dst, sizeof(glm::mat4));
+    glBindBufferRange(GL_UNIFORM_BUFFER, frame_block_binding, ring.Buffer, offset, sizeof(glm::mat4));
+}
+
+/* Render 'count' instances with a single draw call, instance i takes model matrix 'model' + i */
+void draw3DObjectInstanced (struct VAO* vao, int model, int count)
+{
+    if (count <= 0)
+        return;
+
+    setPolygonMode (vao->FillMode);
+    bindVertexArray (vao->VertexArrayID);
+    enableAttrib(0);
+    enableAttrib(1);
+    enableAttrib(2);
+    setModelBase (model);
+    reserveInstanceIds (count);
+
+    frame_draw_calls++;
+    frame_triangles += meshTriangles(vao)*count;
+
+    if (vao->NumIndices)
+        glDrawElementsInstancedBaseVertex(vao->PrimitiveMode, vao->NumIndices, GL_UNSIGNED_SHORT, (void*)(vao->FirstIndex*sizeof(GLushort)), count, vao->FirstVertex);
+    else
+        glDrawArraysInstanced(vao->PrimitiveMode, vao->FirstVertex, vao->NumVertices, count);
+}
 
  // all variables defined here
 float camera_rotation_angle = 0;
 float rectangle_rotation = 180;
 float triangle_rotation = 0;
-float obstacle_rotation[51] ;
 float triangle_rot_dir = 1;
 float rectangle_rot_dir = 1;
 bool triangle_rot_status = false;
@@ -207,19 +1060,38 @@ float targetto[4] = {0,0,0,0};
 float botpos[4] = {0,-0.97f,1.1f,-0.97f};
 float posz=0;
 float posx=0;
+float area_min = 0.0f, area_max = 1.95f; // posx/posz stay within, a --course has no edges
+bool course_mode = false;                 // --course : endless streamed course instead of levels
 float panx =0 ;
 float panz =0;
 int num_obs = 6;
-float obsx[51];
-float obsz[51] ;
 int no_cam = 5 ;
 float camfrom[4] ;
 float camlook[4] ;
 int campos=0;
-double mov[51] ;
-float dir[51] ;
-int visibility[51];
-int appear[51] ;
+
+/* The input state cameraposition() works from, the render thread gets it through the snapshots */
+struct CameraState {
+    int campos;
+    float panx, panz;
+    float mouposx, mouposy;
+    float helcamx, helcamy;
+};
+
+/* Tile store, one cache line aligned array per field */
+struct ObstacleStore {
+    float *x, *z;       // centre on the course
+    float *mov, *dir;   // height offset and the direction it moves in
+    float *prev_mov;    // mov at the previous tick, draw() interpolates between the two
+    int *visibility;    // appear/disappear timer, the tile is shown below appear_time*2/3
+    int *appear;        // tiles with appear % (num_obs/2) == 0 blink instead of moving
+    int *blink;         // that test cached per level as a lane mask, -1 blinks and 0 moves
+    int count, capacity;
+    void* mapping;      // not NULL : the arrays point into this mapped level file, not the heap
+    size_t mapping_bytes;
+};
+ObstacleStore obs = {};
+extern bool tile_grid_dirty;
 float mouposx;
 float mouposy ;
 float mousez;
@@ -248,11 +1120,329 @@ float jump_speed = 1;
 bool jump_allow = false;
 float jump_max=0;
 float jump_min =100000 ;
+int health = 5;
+
+// fixed timestep simulation, see update_world() and idle()
+int tick_rate = 60;          // simulation ticks per second, set with --tick-rate
+int max_ticks_per_frame = 10; // a stalled frame drops time beyond this instead of spiralling
+double sim_accumulator = 0;
+double last_frame_time = -1;
+float prev_posx=0, prev_posz=0, prev_jump=0;
+float swept_posx=0, swept_posz=0, swept_jump=0; // where the last collision check left the player, the next one sweeps from there
+long sim_tick = 0;           // ticks run so far, input logs are timestamped with it
+
+
+
+/* Frame pacing. By default the swap waits for vblank (swap interval 1). --fps caps the frame rate
+   with a sleep before each frame, and is also the fallback when the driver has no swap control.
+   --power-save drops the idle loop : a GLUT timer wakes at the tick rate and a frame is drawn only
+   when the simulation published a new snapshot, between them the process sleeps in the GLUT event
+   loop, which still wakes for input. Achieved FPS and dropped frames go to the window title once a
+   second and the totals are printed at exit */
+struct FramePacing {
+    double target_fps;   // 0 : no limiter
+    int swap_interval;   // -1 : leave the driver default
+    bool power_save;
+    double next_frame;   // when the limiter lets the next frame start
+    double first_swap, last_swap;
+    double budget;       // expected frame interval, a frame taking 1.5 of it dropped one
+    long frames, dropped;
+    long second_frames, second_dropped; // within the current second
+    double second_start;
+    double fps;          // last full second
+    long fps_dropped;
+} pacing = { 0, 1, false, 0, -1, -1, 1.0/60, 0, 0, 0, 0, 0, 0, 0 };
+
+/* Set the number of vblanks per swap through whichever GLX swap control extension the driver has */
+bool setSwapInterval (int interval)
+{
+    Display* display = glXGetCurrentDisplay();
+    if (!display)
+        return false;
+    const char* extensions = glXQueryExtensionsString(display, DefaultScreen(display));
+    if (!extensions)
+        return false;
+
+    typedef void (*SwapIntervalEXT) (Display*, GLXDrawable, int);
+    typedef int (*SwapIntervalMESA) (unsigned int);
+    typedef int (*SwapIntervalSGI) (int);
+    if (strstr(extensions, "GLX_EXT_swap_control")) {
+        SwapIntervalEXT swapInterval = (SwapIntervalEXT) glXGetProcAddressARB((const GLubyte*)"glXSwapIntervalEXT");
+        if (swapInterval) {
+            swapInterval(display, glXGetCurrentDrawable(), interval);
+            return true;
+        }
+    }
+    if (strstr(extensions, "GLX_MESA_swap_control")) {
+        SwapIntervalMESA swapInterval = (SwapIntervalMESA) glXGetProcAddressARB((const GLubyte*)"glXSwapIntervalMESA");
+        if (swapInterval)
+            return swapInterval(interval) == 0;
+    }
+    if (strstr(extensions, "GLX_SGI_swap_control") && interval > 0) { // SGI can not turn vsync off
+        SwapIntervalSGI swapInterval = (SwapIntervalSGI) glXGetProcAddressARB((const GLubyte*)"glXSwapIntervalSGI");
+        if (swapInterval)
+            return swapInterval(interval) == 0;
+    }
+    return false;
+}
+
+/* Apply the pacing options to the window's context */
+void initPacing ()
+{
+    if (pacing.swap_interval >= 0 && !setSwapInterval(pacing.swap_interval)) {
+        cout << "No GLX swap control, vsync stays at the driver default" << endl;
+        if (pacing.swap_interval > 0 && pacing.target_fps <= 0)
+            pacing.target_fps = 60; // don't spin a core when the swap won't wait
+    }
+    if (pacing.target_fps > 0)
+        pacing.budget = 1.0/pacing.target_fps;
+}
+
+/* Sleep until the limiter's next frame start. Sleeps overshoot, the last millisecond is yielded away */
+void paceFrame ()
+{
+    if (pacing.target_fps <= 0)
+        return;
+    double now = elapsed_seconds();
+    if (pacing.next_frame - now > 0.002)
+        std::this_thread::sleep_for(std::chrono::duration<double>(pacing.next_frame - now - 0.001));
+    while (elapsed_seconds() < pacing.next_frame)
+        std::this_thread::yield();
+
+    now = elapsed_seconds();
+    pacing.next_frame += 1.0/pacing.target_fps;
+    if (pacing.next_frame < now)
+        pacing.next_frame = now; // fell behind, carry on from here rather than rush to catch up
+}
+
+/* Count the frame just swapped, and the frames it came too late for */
+void pacingEndFrame ()
+{
+    double now = elapsed_seconds();
+    if (pacing.last_swap < 0)
+        pacing.first_swap = pacing.second_start = now;
+    else if (now - pacing.last_swap > 1.5*pacing.budget && !pacing.power_save) {
+        long missed = (long)((now - pacing.last_swap)/pacing.budget + 0.5) - 1;
+        pacing.dropped += missed;
+        pacing.second_dropped += missed;
+    }
+    pacing.last_swap = now;
+    pacing.frames++;
+    pacing.second_frames++;
+
+    if (now - pacing.second_start >= 1.0) {
+        pacing.fps = pacing.second_frames/(now - pacing.second_start);
+        pacing.fps_dropped = pacing.second_dropped;
+        pacing.second_frames = pacing.second_dropped = 0;
+        pacing.second_start = now;
+    }
+}
+
+void reportPacing ()
+{
+    if (pacing.frames > 1)
+        printf("%ld frames, %.1f fps on average, %ld dropped\n", pacing.frames, (pacing.frames-1)/max(pacing.last_swap - pacing.first_swap, 1e-9), pacing.dropped);
+}
+
+/* Per-frame profiling. Scoped CPU timers (ProfileScope) cover the game logic, matrix and
+   submission phases, GL_TIME_ELAPSED queries (GpuScope) the GL submission phases. Query
+   objects come from a ring gpu_query_frames deep and are read back that many frames later,
+   only once available, so profiling never stalls the pipeline. 'p' shows the overlay,
+   --trace writes every event as Chrome trace-event JSON on exit */
+enum CpuPhase { CPU_SIMULATION, CPU_DESTINATION, CPU_HEALTH, CPU_JUMP, CPU_COLLISION, CPU_TILE_UPDATE,
+                CPU_STREAMING, CPU_MATRICES, CPU_CULLING, CPU_SUBMIT, CPU_PHASES };
+const char* cpu_phase_names[CPU_PHASES] = { "update_world", "checkdestination", "check_health", "jump_func",
+                                            "fall_down", "tile update", "course streaming", "matrices", "culling", "GL submission" };
+enum GpuPhase { GPU_GROUND_BOT, GPU_TILES, GPU_HEADLIGHT, GPU_OVERLAY, GPU_PHASES };
+const char* gpu_phase_names[GPU_PHASES] = { "GPU ground & bot", "GPU tiles", "GPU headlight", "GPU overlay" };
+const int gpu_query_frames = 4;
+const size_t max_trace_events = 4000000;
+
+struct TraceEvent {
+    const char* name;
+    double start, duration; // seconds
+    int track;              // 1 CPU, 2 GPU
+};
+
+struct Profiler {
+    double cpu_ms[CPU_PHASES];    // last finished frame
+    double gpu_ms[GPU_PHASES];    // latest GPU results, gpu_query_frames old
+    GLuint queries[gpu_query_frames][GPU_PHASES];
+    bool pending[gpu_query_frames][GPU_PHASES];
+    double submitted[gpu_query_frames][GPU_PHASES]; // CPU time the phase was submitted, places it in the trace
+    int frame;
+    bool overlay;           // toggled by the input handlers, drawn from the snapshot's copy
+    GLuint OverlayVAO;
+    double last_title;
+    const char* trace_path; // NULL : no trace
+    vector<TraceEvent> events;
+} profiler = {};
+std::mutex trace_mutex;
+
+// each thread sums its own phases, the simulation thread hands its sums over with every snapshot
+thread_local double profile_frame[CPU_PHASES];
+thread_local int profile_track = 1;
+
+void traceEvent (const char* name, double start, double duration, int track)
+{
+    if (profiler.trace_path) {
+        std::lock_guard<std::mutex> lock(trace_mutex);
+        if (profiler.events.size() < max_trace_events) {
+            TraceEvent e = { name, start, duration, track };
+            profiler.events.push_back(e);
+        }
+    }
+}
+
+/* Times the enclosing block into 'phase', several blocks of one phase in a frame add up */
+struct ProfileScope {
+    CpuPhase phase;
+    double start;
+    ProfileScope (CpuPhase p) : phase(p), start(elapsed_seconds()) {}
+    ~ProfileScope () {
+        double end = elapsed_seconds();
+        profile_frame[phase] += (end-start)*1000.0;
+        traceEvent(cpu_phase_names[phase], start, end-start, profile_track);
+    }
+};
+
+/* GPU time of the GL commands issued inside the enclosing block (these scopes must not nest) */
+struct GpuScope {
+    GpuScope (GpuPhase phase) {
+        int slot = profiler.frame % gpu_query_frames;
+        GLuint query = profiler.queries[slot][phase];
+        // collect what this query measured gpu_query_frames ago, if the GPU is done with it
+        if (profiler.pending[slot][phase]) {
+            GLint available = 0;
+            glGetQueryObjectiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+            if (available) {
+                GLuint64 ns = 0;
+                glGetQueryObjectui64v(query, GL_QUERY_RESULT, &ns);
+                profiler.gpu_ms[phase] = ns/1e6;
+                traceEvent(gpu_phase_names[phase], profiler.submitted[slot][phase], ns/1e9, 2);
+            }
+        }
+        profiler.submitted[slot][phase] = elapsed_seconds();
+        profiler.pending[slot][phase] = true;
+        glBeginQuery(GL_TIME_ELAPSED, query);
+    }
+    ~GpuScope () {
+        glEndQuery(GL_TIME_ELAPSED);
+    }
+};
+
+void initProfiler ()
+{
+    for (int f=0; f<gpu_query_frames; f++)
+        glGenQueries(GPU_PHASES, profiler.queries[f]);
+    glGenVertexArrays(1, &profiler.OverlayVAO);
+}
 
+/* Publish this frame's CPU timings, the simulation phases come from the snapshot drawn ('sim_ms').
+   Once a second the window title shows the frame rate, and the timings while the overlay is on */
+void profileEndFrame (const double* sim_ms, bool overlay)
+{
+    for (int p=0; p<CPU_PHASES; p++) {
+        profiler.cpu_ms[p] = p < CPU_MATRICES ? sim_ms[p] : profile_frame[p];
+        profile_frame[p] = 0;
+    }
+    profiler.frame++;
 
+    if (headless)
+        return;
+    double now = elapsed_seconds();
+    if (now - profiler.last_title > 1.0) {
+        char title[256];
+        int n = snprintf(title, sizeof(title), "D.N.A.H.B Games | %.1f fps, %ld dropped", pacing.fps, pacing.fps_dropped);
+        if (overlay)
+            snprintf(title+n, sizeof(title)-n, " | sim %.2f cull %.2f submit %.2f | gpu tiles %.2f ms",
+                     profiler.cpu_ms[CPU_SIMULATION], profiler.cpu_ms[CPU_CULLING], profiler.cpu_ms[CPU_SUBMIT], profiler.gpu_ms[GPU_TILES]);
+        glutSetWindowTitle(title);
+        profiler.last_title = now;
+    }
+}
+
+/* One bar per phase in the top left corner, full width is one 60Hz frame */
+void drawProfileOverlay (bool overlay, int identity_model)
+{
+    if (!overlay)
+        return;
+
+    const float budget_ms = 1000.0f/60.0f;
+    vector<Vertex> bars;
+    for (int row=0; row<CPU_PHASES+GPU_PHASES; row++) {
+        bool cpu = row < CPU_PHASES;
+        double ms = cpu ? profiler.cpu_ms[row] : profiler.gpu_ms[row-CPU_PHASES];
+        float x0 = -0.98f, x1 = x0 + min((float)ms/budget_ms, 1.0f)*0.9f + 0.005f;
+        float y1 = 0.97f - row*0.04f, y0 = y1 - 0.03f;
+        GLubyte r = cpu ? 255 : 60, g = cpu ? 160 : 160, b = cpu ? 40 : 255;
+        const float corners[6][2] = { {x0,y0}, {x1,y0}, {x1,y1}, {x0,y0}, {x1,y1}, {x0,y1} };
+        for (int k=0; k<6; k++) {
+            Vertex v = { corners[k][0], corners[k][1], 0, { r, g, b, 255 } };
+            bars.push_back(v);
+        }
+    }
+
+    GpuScope gpu(GPU_OVERLAY);
+    GLintptr offset;
+    GLsizeiptr bytes = bars.size()*sizeof(Vertex);
+    void* dst = ring_alloc(bytes, &offset);
+    memcpy(dst, &bars[0], bytes);
+    ring_commit(offset, dst, bytes);
+
+    bindVertexArray(profiler.OverlayVAO);
+    bindArrayBuffer(ring.Buffer);
+    enableAttrib(0);
+    enableAttrib(1);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)(offset + offsetof(Vertex, x)));
+    glVertexAttribPointer(1, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(Vertex), (void*)(offset + offsetof(Vertex, color)));
+
+    // straight in clip space, on top of the scene
+    bindFrameBlock(glm::mat4(1.0f));
+    setModelBase(identity_model);
+    setPolygonMode(GL_FILL);
+    glDisable(GL_DEPTH_TEST);
+    glDrawArrays(GL_TRIANGLES, 0, bars.size());
+    glEnable(GL_DEPTH_TEST);
+    frame_draw_calls++;
+    frame_triangles += bars.size()/3;
+}
+
+/* Write the recorded events as Chrome trace-event JSON (chrome://tracing, Perfetto), runs at exit */
+void writeTrace ()
+{
+    FILE* out = fopen(profiler.trace_path, "w");
+    if (!out) {
+        cout << "Error: Can not write trace " << profiler.trace_path << endl;
+        return;
+    }
+    fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(out, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"CPU\"}},\n");
+    fprintf(out, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":2,\"args\":{\"name\":\"GPU\"}},\n");
+    fprintf(out, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":3,\"args\":{\"name\":\"simulation thread\"}}");
+    for (size_t k=0; k<profiler.events.size(); k++) {
+        const TraceEvent& e = profiler.events[k];
+        fprintf(out, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                e.name, e.track, e.start*1e6, e.duration*1e6);
+    }
+    fprintf(out, "\n]}\n");
+    fclose(out);
+    cout << "Wrote " << profiler.events.size() << " trace events to " << profiler.trace_path << endl;
+}
 
 void reshapeWindow(int width,int height);
 
+// the simulation runs on its own thread in a window, inline for --headless and --replay
+std::atomic<bool> sim_threaded(false);
+std::atomic<bool> quit_requested(false);
+
+/* Leave the game once this tick is over. The render loop exits, a replay or --headless run ends
+   there and still prints its state hash */
+void quitGame ()
+{
+    quit_requested = true;
+}
+
 /* Executed when a regular key is pressed */
 void keyboardDown (unsigned char key, int x, int y)
 {
@@ -260,11 +1450,12 @@ void keyboardDown (unsigned char key, int x, int y)
         case 'Q':
         case 'q':
         case 27: //ESC
-            exit (0);
+            quitGame ();
+        break;
         case 'd':
         case 'D':
         if(helicopter == false){
-            if(posx>0.0f)
+            if(posx>area_min)
                 posx-=0.05f*speed;
         }
         else{
@@ -274,7 +1465,7 @@ void keyboardDown (unsigned char key, int x, int y)
         case 'a':
         case 'A':
         if(helicopter == false){
-            if(posx<1.95f)
+            if(posx<area_max)
                 posx+=0.05f*speed;
         }
         else{
@@ -284,7 +1475,7 @@ void keyboardDown (unsigned char key, int x, int y)
         case 'w':
         case 'W':
         if(helicopter == false){
-            if(posz<1.95f)
+            if(posz<area_max)
                 posz+=0.05f*speed;
         }
         else{
@@ -294,7 +1485,7 @@ void keyboardDown (unsigned char key, int x, int y)
         case 's':
         case 'S':
             if(helicopter == false){
-                if(posz>0.0f)
+                if(posz>area_min)
                     posz-=0.05f*speed;
             }
             else{
@@ -352,6 +1543,10 @@ void keyboardDown (unsigned char key, int x, int y)
         case 'H':
             jump_speed+=0.3;
         break;
+        case 'p':
+        case 'P':
+            profiler.overlay = !profiler.overlay;
+        break;
         default:
         break;
     }
@@ -425,15 +1620,13 @@ void mouseClick (int button, int state, int x, int y)
         case 3:
             if(zoom<=300)
             {
-                zoom+=20;
-                reshapeWindow(600,600);
+                zoom+=20; // draw() applies it, on the render thread
             }
         break;
         case 4:
             if(zoom>=-300)
             {
                 zoom-= 20;
-                reshapeWindow(600,600);
             }
         break;
         default:
@@ -457,85 +1650,292 @@ void mouseMotion (int x, int y)
 }
 
 
+/* Input record/replay. Every input goes through dispatchInput, which appends it to the --record
+   log stamped with the tick it lands before. --replay feeds a log back through the same handlers
+   at the same ticks, one tick per frame whatever the clock says, so a run plays back frame for frame.
+   The log holds the layout seed too, everything else in the game is derived from the inputs */
+enum InputType { INPUT_KEY, INPUT_SPECIAL, INPUT_CLICK, INPUT_MOTION, INPUT_END };
+
+struct InputEvent {
+    uint32_t tick;
+    uint8_t type, code, state, pad; // code : key or button
+    int16_t x, y;
+};
+
+const char input_log_magic[4] = { 'D', 'N', 'R', 'L' };
+const uint32_t input_log_version = 4;
+const uint32_t input_log_course = 1; // flags : the run was on a --course
+
+struct InputLogHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t seed;
+    uint32_t tick_rate;
+    uint32_t flags;
+    uint32_t tiles; // on the first level, --tiles
+};
+
+unsigned layout_seed = (unsigned)time(0); // seeds rand() for the tile layouts
+
+struct InputLog {
+    FILE* record;               // NULL : not recording
+    bool replaying;
+    vector<InputEvent> events;  // the log being replayed
+    size_t next;
+} input_log = {};
+
+/* Hash of the simulation state, a replay must end on the same value as the run it recorded */
+unsigned long long stateHash ()
+{
+    std::string state((const char*)&posx, sizeof(posx));
+    state.append((const char*)&posz, sizeof(posz));
+    state.append((const char*)&jump, sizeof(jump));
+    state.append((const char*)&health, sizeof(health));
+    state.append((const char*)&num_obs, sizeof(num_obs));
+    state.append((const char*)obs.mov, num_obs*sizeof(float));
+    state.append((const char*)obs.visibility, num_obs*sizeof(int));
+    return fnv1a(state);
+}
+
+void finishRecording ()
+{
+    InputEvent end = { (uint32_t)sim_tick, INPUT_END, 0, 0, 0, 0, 0 };
+    fwrite(&end, sizeof(end), 1, input_log.record);
+    fclose(input_log.record);
+    printf("Recorded %ld ticks of input, state hash %016llx\n", sim_tick, stateHash());
+}
+
+void startRecording (const char* path)
+{
+    input_log.record = fopen(path, "wb");
+    if (!input_log.record) {
+        cout << "Error: Can not write input log " << path << endl;
+        exit (1);
+    }
+    InputLogHeader header;
+    memcpy(header.magic, input_log_magic, 4);
+    header.version = input_log_version;
+    header.seed = layout_seed;
+    header.tick_rate = tick_rate;
+    header.flags = course_mode ? input_log_course : 0;
+    header.tiles = num_obs;
+    fwrite(&header, sizeof(header), 1, input_log.record);
+    atexit (finishRecording); // the game leaves through exit() from several places
+}
+
+/* Load a log, its seed, tick rate, course mode and tile count replace ours, so call this before the layout is built */
+void startReplay (const char* path)
+{
+    FILE* in = fopen(path, "rb");
+    InputLogHeader header;
+    if (!in || fread(&header, sizeof(header), 1, in) != 1 || memcmp(header.magic, input_log_magic, 4) != 0 || header.version != input_log_version) {
+        cout << "Error: " << path << " is not an input log" << endl;
+        exit (1);
+    }
+    InputEvent e;
+    while (fread(&e, sizeof(e), 1, in) == 1)
+        input_log.events.push_back(e);
+    fclose(in);
+
+    layout_seed = header.seed;
+    tick_rate = max(1, (int)header.tick_rate);
+    course_mode = (header.flags & input_log_course) != 0;
+    num_obs = max(2, (int)header.tiles);
+    input_log.replaying = true;
+    input_log.next = 0;
+}
+
+/* Record an input and pass it on to its handler */
+void dispatchInput (int type, int code, int state, int x, int y)
+{
+    if (input_log.record) {
+        InputEvent e = { (uint32_t)sim_tick, (uint8_t)type, (uint8_t)code, (uint8_t)state, 0, (int16_t)x, (int16_t)y };
+        fwrite(&e, sizeof(e), 1, input_log.record);
+    }
+    switch (type) {
+        case INPUT_KEY: keyboardDown(code, x, y); break;
+        case INPUT_SPECIAL: keyboardSpecialDown(code, x, y); break;
+        case INPUT_CLICK: mouseClick(code, state, x, y); break;
+        case INPUT_MOTION: mouseMotion(x, y); break;
+    }
+}
+
+/* Apply the logged inputs due before the next tick, false once the log has ended or the game quit (q, a death) */
+bool replayInputs ()
+{
+    while (input_log.next < input_log.events.size()) {
+        const InputEvent& e = input_log.events[input_log.next];
+        if (e.tick > sim_tick)
+            return true;
+        if (e.type == INPUT_END || quit_requested)
+            return false;
+        dispatchInput(e.type, e.code, e.state, e.x, e.y);
+        input_log.next++;
+    }
+    return false; // truncated log, stop where it stops
+}
+
+/* Inputs from the GLUT callbacks wait here for the simulation thread, which applies them between ticks */
+std::mutex input_mutex;
+vector<InputEvent> input_queue;
+
+void queueInput (int type, int code, int state, int x, int y)
+{
+    if (!sim_threaded) {
+        dispatchInput(type, code, state, x, y);
+        return;
+    }
+    InputEvent e = { 0, (uint8_t)type, (uint8_t)code, (uint8_t)state, 0, (int16_t)x, (int16_t)y };
+    std::lock_guard<std::mutex> lock(input_mutex);
+    input_queue.push_back(e);
+}
+
+/* GLUT callbacks, live input is ignored while a replay runs (but q/ESC still quit) */
+void onKeyboardDown (unsigned char key, int x, int y)
+{
+    if (input_log.replaying && key != 'q' && key != 'Q' && key != 27)
+        return;
+    queueInput(INPUT_KEY, key, 0, x, y);
+}
+
+void onKeyboardSpecialDown (int key, int x, int y)
+{
+    if (!input_log.replaying)
+        queueInput(INPUT_SPECIAL, key, 0, x, y);
+}
+
+void onMouseClick (int button, int state, int x, int y)
+{
+    if (!input_log.replaying)
+        queueInput(INPUT_CLICK, button, state, x, y);
+}
+
+void onMouseMotion (int x, int y)
+{
+    if (!input_log.replaying)
+        queueInput(INPUT_MOTION, 0, 0, x, y);
+}
+
+
 /* Executed when window is resized to 'width' and 'height' */
 /* Modify the bounds of the screen here in glm::ortho or Field of View in glm::Perspective */
+double view_zoom = 0; // the zoom the projection was built with, render thread side of 'zoom'
+GLsizei viewport_height = 600; // kept by reshapeWindow, for the projected sizes
+
 void reshapeWindow (int width, int height)
 {
 	GLfloat fov = 90.0f;
 
 	// sets the viewport of openGL renderer
 	glViewport (0, 0, (GLsizei) width, (GLsizei) height);
+	viewport_height = height;
 
 	// set the projection matrix as perspective/ortho
 	// Store the projection matrix in a variable for future use
 
     // Matrices.projection = glm::ortho(x, y, x, y, 0.1f, 500.0f);
     // Perspective projection for 3D views
-    Matrices.projection = glm::perspective (fov, (GLfloat) (width - zoom) / (GLfloat) (height +zoom ) , 0.1f, 500.0f);
+    Matrices.projection = glm::perspective (fov, (GLfloat) (width - view_zoom) / (GLfloat) (height +view_zoom ) , 0.1f, 500.0f);
 
     // Ortho projection for 2D views
     // Matrices.projection = glm::ortho(-4.0f, 4.0f, -4.0f, 4.0f, 0.1f, 500.0f);
 }
 
-VAO *triangle, *rectangle,*obstacle[50],*canon;
+VAO *triangle, *rectangle;
+
+/* A mesh in up to mesh_lods versions, lod[0] the finest. Each draw takes the first one
+   its projected size reaches min_pixels of, so far away copies cost fewer vertices */
+const int mesh_lods = 3;
+struct LodMesh {
+    VAO* lod[mesh_lods];
+    float min_pixels[mesh_lods]; // the last level has 0, it takes everything smaller
+    float radius;                // of the bounding sphere the size is measured on
+    int count;
+};
+LodMesh obstacle_lods, canon_lods;
 
-int i=0;
-GLfloat vertex_buffer_data [500] ;
-GLfloat color_buffer_data [500] ;
+const int canon_segments[mesh_lods] = { 24, 12, 6 };
+const float canon_lod_pixels[mesh_lods] = { 48, 12, 0 };
+const float obstacle_lod_pixels[mesh_lods] = { 16, 4, 0 };
 
-void add(GLdouble x,GLdouble y)
+/* Headlight beam : a fan of 'segments' triangles from the lamp at the origin to a
+   ring of 'radius' around (centrex,centrey) */
+vector<Vertex> discVertices (double centrex, double centrey, double radius, int segments)
 {
-    vertex_buffer_data[i]=x;
-    color_buffer_data[i++]=1  ;
-    vertex_buffer_data[i]=y;
-    color_buffer_data[i++]=1;
-    vertex_buffer_data[i]=0;
-    color_buffer_data[i++]=1;
+    const double TWO_PI = 6.2831853;
+    Vertex lamp = { 0, 0, 0, { 255, 255, 255, 255 } };
+    vector<Vertex> vertices(3*segments, lamp);
+    for (int j=0; j<segments; j++) {
+        // triangle j : the lamp, ring points j and j+1
+        for (int k=1; k<=2; k++) {
+            double theta = TWO_PI * (j+k-1)/segments;
+            vertices[3*j + k].x = centrex + radius * cos(theta);
+            vertices[3*j + k].y = centrey + radius * sin(theta);
+        }
+    }
+    return vertices;
+}
 
+/* Coarser copy of a triangle list cube : lod 1 drops the bottom face, which the camera is never
+   under, lod 2 keeps only the top face, all a cube a few pixels across shows from above */
+vector<Vertex> simplifyCube (const vector<Vertex>& cube, int lod)
+{
+    if (lod == 0)
+        return cube;
+    float miny = cube[0].y, maxy = cube[0].y;
+    for (size_t v=1; v<cube.size(); v++) {
+        miny = min(miny, cube[v].y);
+        maxy = max(maxy, cube[v].y);
+    }
+    vector<Vertex> out;
+    for (size_t t=0; t+2<cube.size(); t+=3) {
+        bool bottom = cube[t].y == miny && cube[t+1].y == miny && cube[t+2].y == miny;
+        bool top = cube[t].y == maxy && cube[t+1].y == maxy && cube[t+2].y == maxy;
+        if (lod == 1 ? !bottom : top)
+            out.insert(out.end(), cube.begin()+t, cube.begin()+t+3);
+    }
+    return out;
 }
 
-void createcanon (GLdouble centrex,GLdouble centrey)
+/* Upload 'count' levels of a mesh, stored as 'format' */
+void createLodMesh (LodMesh& m, const IndexedMesh* lods, const float* min_pixels, int count, float radius, VertexFormat format)
 {
-  /* ONLY vertices between the bounds specified in glm::ortho will be visible on screen */
-    const double TWO_PI = 6.2831853;
-    GLdouble hexTheta,x,y,radius_canon=.03,previousx,previousy;
-    // adds point to the vertex_buffer array
-
-    hexTheta = TWO_PI * 0/20;
-    x = centrex + radius_canon * cos(hexTheta);
-    y = centrey + radius_canon * sin(hexTheta);
-    add(0,0);
-    add(x,y);
-    hexTheta = TWO_PI * 1/20;
-    x = centrex + radius_canon * cos(hexTheta);
-    y = centrey + radius_canon * sin(hexTheta);
-    add(x,y);
-    previousy = y;
-    previousx = x;
-
-    int j;
-    // building many triangles to form one circle
-    for(j=2;j<=20;j++)
-    {
-        hexTheta = TWO_PI * j/20;
-        // defining the new vertices
-        x = centrex + radius_canon * cos(hexTheta);
-        y = centrey + radius_canon * sin(hexTheta);
-        // assigining vertices to new triangle
-        add(0,0);
-        add(previousx,previousy);
-        add(x,y);
-        previousy = y;
-        previousx = x;
+    for (int l=0; l<count; l++) {
+        // create3DObject creates and returns a handle to a VAO that can be used later
+        m.lod[l] = create3DObject(GL_TRIANGLES, lods[l], GL_FILL, format);
+        m.min_pixels[l] = min_pixels[l];
     }
+    m.radius = radius;
+    m.count = count;
+}
 
-  // create3DObject creates and returns a handle to a VAO that can be used later
-  canon = create3DObject(GL_TRIANGLES, 180, vertex_buffer_data, color_buffer_data, GL_FILL);
-  i=0;
+void createcanon (const IndexedMesh* lods)
+{
+  // the disc's rim isn't on a grid of its bounding box, half floats keep its points to 1 part in 2048
+  createLodMesh(canon_lods, lods, canon_lod_pixels, mesh_lods, 0.11f, VERTEX_HALF); // the beam is 0.2 long
+}
+
+/* Height in pixels of a sphere of radius r at p, seen through VP */
+float projectedPixels (const glm::mat4& VP, const glm::vec3& p, float r)
+{
+    float w = VP[0][3]*p.x + VP[1][3]*p.y + VP[2][3]*p.z + VP[3][3]; // clip w, the distance along the view axis
+    if (w <= r)
+        return 1e9f; // around or behind the eye, as big as it gets
+    return r * Matrices.projection[1][1] / w * viewport_height;
 }
 
+/* The level of detail to draw m with at 'pixels' across */
+int pickLod (const LodMesh& m, float pixels)
+{
+    int l = 0;
+    while (l+1 < m.count && pixels < m.min_pixels[l])
+        l++;
+    return l;
+}
 
-void createground ()
+
+/* Ground cube, 12 triangles */
+vector<Vertex> groundVertices ()
 {
   /* ONLY vertices between the bounds specified in glm::ortho will be visible on screen */
 
@@ -688,11 +2088,17 @@ void createground ()
        0.982f,  0.099f,  0.879f
   };
 
+  return interleave(36, vertex_buffer_data, color_buffer_data);
+}
+
+void createground (const IndexedMesh& mesh)
+{
   // create3DObject creates and returns a handle to a VAO that can be used later
-  triangle = create3DObject(GL_TRIANGLES, 36, vertex_buffer_data, color_buffer_data, GL_FILL);
+  triangle = create3DObject(GL_TRIANGLES, mesh, GL_FILL, VERTEX_PACKED); // a box, packed exactly
 }
 
-void createbot ()
+/* Player cube, 12 triangles */
+vector<Vertex> botVertices ()
 {
   // GL3 accepts only Triangles. Quads are not supported static
   static const GLfloat vertex_buffer_data [] = {
@@ -844,12 +2250,217 @@ void createbot ()
   };
 
 
+  return interleave(36, vertex_buffer_data, color_buffer_data);
+}
+
+void createbot (const IndexedMesh& mesh)
+{
   // create3DObject creates and returns a handle to a VAO that can be used later
-  rectangle = create3DObject(GL_TRIANGLES, 36, vertex_buffer_data, color_buffer_data, GL_FILL);
+  rectangle = create3DObject(GL_TRIANGLES, mesh, GL_FILL, VERTEX_PACKED); // a box, packed exactly
+}
+
+
+/* Copy 'count' elements of 'old' into a new 64-byte aligned array of 'capacity' elements */
+template <class T> T* grow_array (T* old, int count, int capacity, bool owned = true)
+{
+    size_t bytes = (capacity*sizeof(T) + 63) / 64 * 64; // aligned_alloc wants a multiple of the alignment
+    T* a = (T*) aligned_alloc(64, bytes);
+    if (old) {
+        memcpy(a, old, count*sizeof(T));
+        if (owned) // not when old points into a mapped level
+            free(old);
+    }
+    return a;
+}
+
+/* Make room for at least n tiles without moving the arrays again */
+void reserve_obstacles (int n)
+{
+    if (n <= obs.capacity)
+        return;
+    int capacity = max(n, 2*obs.capacity);
+    bool owned = !obs.mapping;
+    obs.x = grow_array(obs.x, obs.count, capacity, owned);
+    obs.z = grow_array(obs.z, obs.count, capacity, owned);
+    obs.mov = grow_array(obs.mov, obs.count, capacity, owned);
+    obs.dir = grow_array(obs.dir, obs.count, capacity, owned);
+    obs.prev_mov = grow_array(obs.prev_mov, obs.count, capacity, owned);
+    obs.visibility = grow_array(obs.visibility, obs.count, capacity, owned);
+    obs.appear = grow_array(obs.appear, obs.count, capacity, owned);
+    obs.blink = grow_array(obs.blink, obs.count, capacity, owned);
+    obs.capacity = capacity;
+    if (obs.mapping) {
+        munmap(obs.mapping, obs.mapping_bytes);
+        obs.mapping = NULL;
+    }
+}
+
+/* Scatter random tiles until there are n of them */
+void spawn_obstacles (int n)
+{
+    reserve_obstacles(n);
+    int temp,temp2,temp3;
+    for(int r=obs.count;r<n;r++)
+    {
+      obs.mov[r] = rand()%5;
+      obs.mov[r] /=100;
+      temp = rand()%2;
+      temp2 = rand()%num_obs;
+      temp3 = rand()%appear_time;
+      if(temp==0)
+      {
+          temp++;
+      }
+      else{
+          temp*=-1;
+      }
+      obs.x[r] = rand()%10;
+      obs.x[r] /=10;
+      obs.x[r] *= temp;
+      obs.z[r] = rand()%10;
+      obs.z[r] /=10;
+      obs.z[r] *=temp;
+      obs.dir[r] = temp;
+      obs.appear[r] = temp2;
+      obs.visibility[r]=temp3;
+      obs.prev_mov[r] = obs.mov[r];
+    }
+    obs.count = n;
+    tile_grid_dirty = true;
+
+    // num_obs changed, so which tiles blink has to be worked out again
+    for(int r=0;r<n;r++)
+        obs.blink[r] = (obs.appear[r]%(num_obs/2)==0) ? -1 : 0;
+}
+
+/* One tick of tile movement for tiles [begin, end), plain C++.
+   Blinking tiles count their visibility timer up and wrap it, the others
+   bounce their height offset between -0.06 and 0.05 */
+void update_obstacles_scalar (float* mov, float* dir, int* visibility, const int* blink, int begin, int end, int appear_time)
+{
+    for (int r=begin; r<end; r++) {
+        if (blink[r]) {
+            int v = visibility[r] + 1;
+            visibility[r] = (v > appear_time) ? 1 : v;
+        }
+        else {
+            float m = mov[r], d = dir[r];
+            if (m > 0.05f || m < -0.06f)
+                d = -d;
+            dir[r] = d;
+            mov[r] = m + 0.001f*d;
+        }
+    }
+}
+
+/* Same update as update_obstacles_scalar, several tiles per instruction with
+   masked selects instead of branches. The arrays must be 16 (SSE2) or 32 (AVX2) byte
+   aligned, which ObstacleStore guarantees. dir is always +-1, so 0.001f*d is exact and
+   the result is bit for bit the scalar one even when the compiler fuses the multiply-add */
+void update_obstacles (float* mov, float* dir, int* visibility, const int* blink, int n, int appear_time)
+{
+    int r = 0;
+#if defined(__AVX2__)
+    const __m256 hi = _mm256_set1_ps(0.05f), lo = _mm256_set1_ps(-0.06f), step = _mm256_set1_ps(0.001f);
+    const __m256 sign = _mm256_set1_ps(-0.0f);
+    const __m256i one = _mm256_set1_epi32(1), limit = _mm256_set1_epi32(appear_time);
+    for (; r+8 <= n; r+=8) {
+        __m256 m = _mm256_load_ps(mov + r);
+        __m256 d = _mm256_load_ps(dir + r);
+        __m256i v = _mm256_load_si256((const __m256i*)(visibility + r));
+        __m256i b = _mm256_load_si256((const __m256i*)(blink + r));
+
+        __m256 flip = _mm256_or_ps(_mm256_cmp_ps(m, hi, _CMP_GT_OQ), _mm256_cmp_ps(m, lo, _CMP_LT_OQ));
+        __m256 nd = _mm256_xor_ps(d, _mm256_and_ps(flip, sign));
+        __m256 nm = _mm256_add_ps(m, _mm256_mul_ps(step, nd));
+        __m256i nv = _mm256_add_epi32(v, one);
+        nv = _mm256_blendv_epi8(nv, one, _mm256_cmpgt_epi32(nv, limit));
+
+        __m256 bf = _mm256_castsi256_ps(b);
+        _mm256_store_ps(mov + r, _mm256_blendv_ps(nm, m, bf));
+        _mm256_store_ps(dir + r, _mm256_blendv_ps(nd, d, bf));
+        _mm256_store_si256((__m256i*)(visibility + r), _mm256_blendv_epi8(v, nv, b));
+    }
+#elif defined(__SSE2__)
+    const __m128 hi = _mm_set1_ps(0.05f), lo = _mm_set1_ps(-0.06f), step = _mm_set1_ps(0.001f);
+    const __m128 sign = _mm_set1_ps(-0.0f);
+    const __m128i one = _mm_set1_epi32(1), limit = _mm_set1_epi32(appear_time);
+    for (; r+4 <= n; r+=4) {
+        __m128 m = _mm_load_ps(mov + r);
+        __m128 d = _mm_load_ps(dir + r);
+        __m128i v = _mm_load_si128((const __m128i*)(visibility + r));
+        __m128i b = _mm_load_si128((const __m128i*)(blink + r));
+
+        __m128 flip = _mm_or_ps(_mm_cmpgt_ps(m, hi), _mm_cmplt_ps(m, lo));
+        __m128 nd = _mm_xor_ps(d, _mm_and_ps(flip, sign));
+        __m128 nm = _mm_add_ps(m, _mm_mul_ps(step, nd));
+        __m128i nv = _mm_add_epi32(v, one);
+        __m128i wrap = _mm_cmpgt_epi32(nv, limit);
+        nv = _mm_or_si128(_mm_and_si128(wrap, one), _mm_andnot_si128(wrap, nv));
+
+        // SSE2 has no blend, select with and/andnot/or
+        __m128 bf = _mm_castsi128_ps(b);
+        _mm_store_ps(mov + r, _mm_or_ps(_mm_and_ps(bf, m), _mm_andnot_ps(bf, nm)));
+        _mm_store_ps(dir + r, _mm_or_ps(_mm_and_ps(bf, d), _mm_andnot_ps(bf, nd)));
+        _mm_store_si128((__m128i*)(visibility + r), _mm_or_si128(_mm_and_si128(b, nv), _mm_andnot_si128(b, v)));
+    }
+#endif
+    // what is left over (or everything, without SIMD)
+    update_obstacles_scalar(mov, dir, visibility, blink, r, n, appear_time);
 }
 
+/* --self-test : run update_obstacles and update_obstacles_scalar side by side on random tiles,
+   counts that leave a tail included, and check they stay bit for bit the same. Returns the exit status */
+int selfTest ()
+{
+    const int counts[] = { 1, 3, 7, 8, 9, 15, 16, 17, 31, 33, 100, 1003 };
+    const int ticks = 5000;
+    srand(12345);
+    int failures = 0;
+    for (size_t c=0; c<sizeof(counts)/sizeof(counts[0]); c++) {
+        int n = counts[c];
+        int appear_time = 20 + rand()%200;
+        float* mov[2]; float* dir[2]; int* visibility[2];
+        int* blink = grow_array<int>(NULL, 0, n);
+        for (int k=0; k<2; k++) {
+            mov[k] = grow_array<float>(NULL, 0, n);
+            dir[k] = grow_array<float>(NULL, 0, n);
+            visibility[k] = grow_array<int>(NULL, 0, n);
+        }
+        for (int r=0; r<n; r++) {
+            // heights across the whole bounce range and past both ends
+            mov[0][r] = mov[1][r] = (rand()%1400 - 800)/10000.0f;
+            dir[0][r] = dir[1][r] = rand()%2 ? 1.0f : -1.0f;
+            visibility[0][r] = visibility[1][r] = rand()%(appear_time+1);
+            blink[r] = rand()%3 == 0 ? -1 : 0;
+        }
+
+        int t = 0;
+        for (; t<ticks; t++) {
+            update_obstacles(mov[0], dir[0], visibility[0], blink, n, appear_time);
+            update_obstacles_scalar(mov[1], dir[1], visibility[1], blink, 0, n, appear_time);
+            if (memcmp(mov[0], mov[1], n*sizeof(float)) || memcmp(dir[0], dir[1], n*sizeof(float)) ||
+                memcmp(visibility[0], visibility[1], n*sizeof(int)))
+                break;
+        }
+        if (t < ticks) {
+            cout << "update_obstacles, " << n << " tiles : differs from the scalar update at tick " << t << endl;
+            failures++;
+        }
+
+        free(blink);
+        for (int k=0; k<2; k++) {
+            free(mov[k]);
+            free(dir[k]);
+            free(visibility[k]);
+        }
+    }
+    cout << "self test: " << (failures ? "FAILED" : "passed") << endl;
+    return failures ? 1 : 0;
+}
 
-void createobstacle ()
+/* Tile cube, 12 black triangles */
+vector<Vertex> obstacleVertices ()
 {
   // GL3 accepts only Triangles. Quads are not supported static
   static const GLfloat vertex_buffer_data [] = {
@@ -966,44 +2577,541 @@ void createobstacle ()
 
   };
 
-  // create3DObject creates and returns a handle to a VAO that can be used later
-  srand((unsigned)time(0));
-  int temp,temp2,temp3;
-  for(int r=1;r<=50;r++)
-  {
-      obstacle[r] = create3DObject(GL_TRIANGLES, 36, vertex_buffer_data, color_buffer_data, GL_FILL);
-      mov[r] = rand()%5;
-      mov[r] /=100;
-      temp = rand()%2;
-      temp2 = rand()%num_obs;
-      temp3 = rand()%appear_time;
-      if(temp==0)
-      {
-          temp++;
-      }
-      else{
-          temp*=-1;
-      }
-      obsx[r] = rand()%10;
-      obsx[r] /=10;
-      obsx[r] *= temp;
-      obsz[r] = rand()%10;
-      obsz[r] /=10;
-      obsz[r] *=temp;
-      dir[r] = temp;
-      appear[r] = temp2;
-      visibility[r]=temp3;
+  return interleave(36, vertex_buffer_data, color_buffer_data);
+}
+
+void createobstacle (const IndexedMesh* lods)
+{
+  // all the tiles share these cubes, their transforms come from the frame's model block
+  createLodMesh(obstacle_lods, lods, obstacle_lod_pixels, mesh_lods, 0.087f, VERTEX_PACKED); // half the diagonal
+}
+
+/* --course : an endless course laid out chunk by chunk from layout_seed instead of one random level.
+   Chunk (cx,cz) covers [cx*chunk_size-1, (cx+1)*chunk_size-1) in x and z, (0,0) is the board the
+   player starts on. A generator thread builds chunks as the player comes near them, chunks left far
+   behind give their slots back, so the tile store never holds more than course_max_chunks chunks */
+const float chunk_size = 2.0f;
+const int chunk_tiles = 32;                     // a multiple of job_align, chunks start on SIMD lanes
+const int course_radius = 2;                    // chunks kept loaded around the player's, each way
+const int course_keep = course_radius + 1;      // evicted only beyond this, walking along a chunk edge won't thrash
+const int course_max_chunks = (2*course_keep+1)*(2*course_keep+1);
+const int course_lead_ticks = 10;               // a chunk asked for at tick t joins the course at t+10
+const float course_extent = 100000.0f;          // posx/posz bound, floats still step by 0.05 out there
+
+/* Tiles of one chunk, the fields of ObstacleStore */
+struct CourseChunk {
+    int cx, cz;
+    float x[chunk_tiles], z[chunk_tiles], mov[chunk_tiles], dir[chunk_tiles];
+    int visibility[chunk_tiles], appear[chunk_tiles], blink[chunk_tiles];
+};
+
+struct CourseRequest {
+    int cx, cz;
+    long due; // tick it joins the course, whether or not the generator was quick, so replays match
+};
+
+struct Course {
+    vector<CourseRequest> resident;       // chunk in slot i owns tiles [i*chunk_tiles, (i+1)*chunk_tiles)
+    vector<CourseRequest> pending;        // asked of the generator, not on the course yet
+    long generated, evicted;
+
+    // shared with the generator thread
+    std::thread generator;
+    std::mutex mutex;
+    std::condition_variable wake, finished;
+    std::deque<CourseRequest> requests;
+    std::map<long long, CourseChunk*> ready;
+    bool stop;
+} course;
+
+long long chunkKey (int cx, int cz)
+{
+    return ((long long)cx << 32) | (unsigned)cz;
+}
+
+/* Chunk coordinate of course position v */
+int courseChunkOf (float v)
+{
+    return (int)floor((v + 1.0f)/chunk_size);
+}
+
+/* splitmix64, a small generator whose whole state is one seedable word */
+unsigned long long nextRandom (unsigned long long& state)
+{
+    unsigned long long z = (state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+/* Lay out chunk (cx,cz). Depends on nothing but the seed and the coordinates, so a chunk evicted
+   and visited again comes back the same, whichever thread builds it */
+void generateChunk (CourseChunk& c, int cx, int cz)
+{
+    std::string where((const char*)&cx, sizeof(cx));
+    where.append((const char*)&cz, sizeof(cz));
+    unsigned long long state = fnv1a(where, 14695981039346656037ULL ^ layout_seed);
+    c.cx = cx;
+    c.cz = cz;
+    float x0 = cx*chunk_size - 1.0f, z0 = cz*chunk_size - 1.0f;
+    for (int r=0; r<chunk_tiles; r++) {
+        do {
+            c.x[r] = x0 + 0.05f + (nextRandom(state) % 1000)*(chunk_size-0.1f)/1000;
+            c.z[r] = z0 + 0.05f + (nextRandom(state) % 1000)*(chunk_size-0.1f)/1000;
+        } while (fabs(c.x[r]-botpos[1]) < 0.3f && fabs(c.z[r]-botpos[3]) < 0.3f); // clear of the start
+        c.mov[r] = (nextRandom(state) % 5)/100.0f;
+        c.dir[r] = (nextRandom(state) % 2) ? 1 : -1;
+        c.visibility[r] = nextRandom(state) % appear_time;
+        c.appear[r] = nextRandom(state) % chunk_tiles;
+        c.blink[r] = (nextRandom(state) % 8 == 0) ? -1 : 0;
+    }
+}
+
+void generatorLoop ()
+{
+    std::unique_lock<std::mutex> lock(course.mutex);
+    while (true) {
+        course.wake.wait(lock, [] { return course.stop || !course.requests.empty(); });
+        if (course.stop)
+            return;
+        CourseRequest req = course.requests.front();
+        course.requests.pop_front();
+        lock.unlock();
+        CourseChunk* c = new CourseChunk;
+        generateChunk(*c, req.cx, req.cz);
+        lock.lock();
+        course.ready[chunkKey(req.cx, req.cz)] = c;
+        course.finished.notify_all();
+    }
+}
+
+/* Copy chunk c into the next free slot of the tile store */
+void addChunk (const CourseChunk& c)
+{
+    int b = course.resident.size()*chunk_tiles;
+    memcpy(obs.x+b, c.x, sizeof(c.x));
+    memcpy(obs.z+b, c.z, sizeof(c.z));
+    memcpy(obs.mov+b, c.mov, sizeof(c.mov));
+    memcpy(obs.prev_mov+b, c.mov, sizeof(c.mov));
+    memcpy(obs.dir+b, c.dir, sizeof(c.dir));
+    memcpy(obs.visibility+b, c.visibility, sizeof(c.visibility));
+    memcpy(obs.appear+b, c.appear, sizeof(c.appear));
+    memcpy(obs.blink+b, c.blink, sizeof(c.blink));
+    CourseRequest slot = { c.cx, c.cz, sim_tick };
+    course.resident.push_back(slot);
+    obs.count = num_obs = course.resident.size()*chunk_tiles;
+    course.generated++;
+    tile_grid_dirty = true;
+}
+
+/* Drop the chunk in slot i, the last slot moves into its place */
+void evictChunk (int i)
+{
+    int last = course.resident.size()-1;
+    if (i != last) {
+        int b = i*chunk_tiles, e = last*chunk_tiles;
+        memcpy(obs.x+b, obs.x+e, chunk_tiles*sizeof(float));
+        memcpy(obs.z+b, obs.z+e, chunk_tiles*sizeof(float));
+        memcpy(obs.mov+b, obs.mov+e, chunk_tiles*sizeof(float));
+        memcpy(obs.prev_mov+b, obs.prev_mov+e, chunk_tiles*sizeof(float));
+        memcpy(obs.dir+b, obs.dir+e, chunk_tiles*sizeof(float));
+        memcpy(obs.visibility+b, obs.visibility+e, chunk_tiles*sizeof(int));
+        memcpy(obs.appear+b, obs.appear+e, chunk_tiles*sizeof(int));
+        memcpy(obs.blink+b, obs.blink+e, chunk_tiles*sizeof(int));
+        course.resident[i] = course.resident[last];
+    }
+    course.resident.pop_back();
+    obs.count = num_obs = course.resident.size()*chunk_tiles;
+    course.evicted++;
+    tile_grid_dirty = true;
+}
+
+bool chunkWanted (int cx, int cz, int pcx, int pcz, int range)
+{
+    return abs(cx-pcx) <= range && abs(cz-pcz) <= range;
+}
+
+/* Once a tick : evict chunks left behind, add the ones that are due and ask for the ones coming into range */
+void streamCourse ()
+{
+    if (!course_mode)
+        return;
+    int pcx = courseChunkOf(botpos[1]+posx), pcz = courseChunkOf(botpos[3]+posz);
+
+    for (int i=course.resident.size()-1; i>=0; i--)
+        if (!chunkWanted(course.resident[i].cx, course.resident[i].cz, pcx, pcz, course_keep))
+            evictChunk(i);
+
+    for (size_t k=0; k<course.pending.size(); ) {
+        CourseRequest req = course.pending[k];
+        if (req.due > sim_tick) {
+            k++;
+            continue;
+        }
+        CourseChunk* c;
+        {
+            // normally long done, the tick only waits when the generator fell behind
+            std::unique_lock<std::mutex> lock(course.mutex);
+            long long key = chunkKey(req.cx, req.cz);
+            course.finished.wait(lock, [key] { return course.ready.count(key) != 0; });
+            c = course.ready[key];
+            course.ready.erase(key);
+        }
+        if (chunkWanted(req.cx, req.cz, pcx, pcz, course_keep))
+            addChunk(*c);
+        delete c;
+        course.pending.erase(course.pending.begin()+k);
+    }
+
+    for (int cz=pcz-course_radius; cz<=pcz+course_radius; cz++)
+    for (int cx=pcx-course_radius; cx<=pcx+course_radius; cx++) {
+        bool known = false;
+        for (size_t i=0; i<course.resident.size() && !known; i++)
+            known = course.resident[i].cx == cx && course.resident[i].cz == cz;
+        for (size_t k=0; k<course.pending.size() && !known; k++)
+            known = course.pending[k].cx == cx && course.pending[k].cz == cz;
+        if (known)
+            continue;
+        CourseRequest req = { cx, cz, sim_tick + course_lead_ticks };
+        course.pending.push_back(req);
+        std::lock_guard<std::mutex> lock(course.mutex);
+        course.requests.push_back(req);
+        course.wake.notify_one();
+    }
+}
+
+/* The chunks around the start, built right away, the player can't wait for them */
+void createCourse ()
+{
+    reserve_obstacles(course_max_chunks*chunk_tiles);
+    int pcx = courseChunkOf(botpos[1]+posx), pcz = courseChunkOf(botpos[3]+posz);
+    CourseChunk c;
+    for (int cz=pcz-course_radius; cz<=pcz+course_radius; cz++)
+    for (int cx=pcx-course_radius; cx<=pcx+course_radius; cx++) {
+        generateChunk(c, cx, cz);
+        addChunk(c);
+    }
+}
+
+void stopCourse ()
+{
+    {
+        std::lock_guard<std::mutex> lock(course.mutex);
+        course.stop = true;
+        course.wake.notify_one();
+    }
+    if (course.generator.joinable())
+        course.generator.join();
+    for (std::map<long long, CourseChunk*>::iterator it=course.ready.begin(); it!=course.ready.end(); ++it)
+        delete it->second;
+    course.ready.clear();
+    printf("Course: %ld chunks generated, %ld evicted, %d resident\n", course.generated, course.evicted, (int)course.resident.size());
+}
+
+/* Lift the board's edges and start the generator thread, before the layout is built */
+void startCourse ()
+{
+    area_min = -course_extent;
+    area_max = course_extent;
+    course.generator = std::thread(generatorLoop);
+    atexit (stopCourse); // registered ahead of the simulation thread's handler, it runs after that thread is gone
+}
+
+/* Level file : a LevelHeader, then the tile store's arrays as they are in memory, little-endian */
+const char level_magic[4] = { 'D', 'N', 'L', 'V' };
+const uint32_t level_version = 1;
+
+enum LevelField { LEVEL_X, LEVEL_Z, LEVEL_MOV, LEVEL_DIR, LEVEL_PREV_MOV, LEVEL_VISIBILITY, LEVEL_APPEAR, LEVEL_BLINK, LEVEL_FIELDS };
+
+struct LevelHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t count;
+    uint32_t appear_time;           // the timers only make sense for the appear_time they were saved with
+    uint64_t offset[LEVEL_FIELDS];  // bytes from the start of the file, a multiple of 64
+};
+
+/* Write the tile store to 'path' */
+void saveLevel (const char* path)
+{
+    FILE* out = fopen(path, "wb");
+    if (!out) {
+        cout << "Error: Can not write level " << path << endl;
+        exit (1);
+    }
+    const void* field[LEVEL_FIELDS] = { obs.x, obs.z, obs.mov, obs.dir, obs.prev_mov, obs.visibility, obs.appear, obs.blink };
+    size_t array_bytes = (obs.count*sizeof(float) + 63) / 64 * 64; // every field is 4 bytes a tile
+    LevelHeader header = {};
+    memcpy(header.magic, level_magic, 4);
+    header.version = level_version;
+    header.count = obs.count;
+    header.appear_time = appear_time;
+    for (int f=0; f<LEVEL_FIELDS; f++)
+        header.offset[f] = (sizeof(header) + 63) / 64 * 64 + f*array_bytes;
+
+    static const char zeros[64] = {};
+    fwrite(&header, sizeof(header), 1, out);
+    fwrite(zeros, header.offset[0] - sizeof(header), 1, out);
+    for (int f=0; f<LEVEL_FIELDS; f++) {
+        fwrite(field[f], sizeof(float), obs.count, out);
+        fwrite(zeros, array_bytes - obs.count*sizeof(float), 1, out);
+    }
+    if (fclose(out) != 0) {
+        cout << "Error: Can not write level " << path << endl;
+        exit (1);
+    }
+    printf("Saved %d tiles to %s\n", obs.count, path);
+}
+
+/* Map level 'path' privately and point the tile store at it */
+void loadLevel (const char* path)
+{
+    double start = elapsed_seconds();
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(LevelHeader)) {
+        cout << "Error: Can not read level " << path << endl;
+        exit (1);
+    }
+    void* map = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        cout << "Error: Can not map level " << path << endl;
+        exit (1);
+    }
+
+    const LevelHeader& header = *(const LevelHeader*)map;
+    bool valid = memcmp(header.magic, level_magic, 4) == 0 && header.version == level_version &&
+                 header.count >= 2 && (int)header.appear_time == appear_time;
+    for (int f=0; f<LEVEL_FIELDS && valid; f++)
+        valid = header.offset[f] % 64 == 0 && header.offset[f] <= (uint64_t)st.st_size &&
+                header.count <= (st.st_size - header.offset[f])/sizeof(float);
+    if (!valid) {
+        cout << "Error: " << path << " is not a level of this version" << endl;
+        exit (1);
+    }
+
+    char* base = (char*)map;
+    obs.x = (float*)(base + header.offset[LEVEL_X]);
+    obs.z = (float*)(base + header.offset[LEVEL_Z]);
+    obs.mov = (float*)(base + header.offset[LEVEL_MOV]);
+    obs.dir = (float*)(base + header.offset[LEVEL_DIR]);
+    obs.prev_mov = (float*)(base + header.offset[LEVEL_PREV_MOV]);
+    obs.visibility = (int*)(base + header.offset[LEVEL_VISIBILITY]);
+    obs.appear = (int*)(base + header.offset[LEVEL_APPEAR]);
+    obs.blink = (int*)(base + header.offset[LEVEL_BLINK]);
+    obs.count = obs.capacity = num_obs = header.count;
+    obs.mapping = map;
+    obs.mapping_bytes = st.st_size;
+    tile_grid_dirty = true;
+    printf("Loaded %d tiles from %s in %.3f ms\n", num_obs, path, (elapsed_seconds()-start)*1000.0);
+}
+
+const char* level_path = NULL; // --level : first level from this file instead of random
+
+/* Tile layout of the first level, random or from --level, or the start of the course */
+void createlayout ()
+{
+  if (course_mode) {
+    createCourse();
+    return;
   }
+  srand(layout_seed); // later levels stay random
+  if (level_path)
+    loadLevel(level_path);
+  else
+    spawn_obstacles(num_obs);
 }
 
-void fall_down(){
-    for(int r=1;r<=num_obs;r++){
-        if(botpos[1]+posx<=(obsx[r]+0.095f) && botpos[1]+posx>=(obsx[r]-0.095f) && botpos[3]+posz<=(obsz[r]+0.095) && botpos[3]+posz>=(obsz[r]-0.095) &&
-            visibility[r]<appear_time*2/3 && (botpos[2]-0.09f+jump)-(botpos[2]-0.12f+mov[r])<0.5) {
-            cout<<"You Lose!!"<<endl;
-            exit(0);
+/* CPU side of the startup assets, prepared on worker threads while the window and GL context come up.
+   Only GL uploads are left for initGL, which waits for them before the first frame */
+struct StartupMeshes {
+    IndexedMesh ground, bot;
+    IndexedMesh obstacle[mesh_lods], canon[mesh_lods];
+};
+struct StartupShaders {
+    std::string vertex, fragment;
+};
+std::future<StartupMeshes> meshes_ready;
+std::future<StartupShaders> shaders_ready;
+std::future<bool> audio_ready;
+
+void startAssetLoads (bool audio)
+{
+    if (audio)
+        audio_ready = std::async(std::launch::async, [] { return buffer1.loadFromFile("Helicopter.wav"); });
+
+    meshes_ready = std::async(std::launch::async, [] {
+        StartupMeshes m;
+        m.ground = indexMesh(groundVertices());
+        m.bot = indexMesh(botVertices());
+        vector<Vertex> cube = obstacleVertices();
+        for (int l=0; l<mesh_lods; l++) {
+            m.obstacle[l] = indexMesh(simplifyCube(cube, l));
+            m.canon[l] = indexMesh(discVertices(0.2f, 0, .03, canon_segments[l])); // pointed at -3   .5,-3
+        }
+        createlayout(); // nothing else touches the tile store or rand() until initGL
+        return m;
+    });
+
+    shaders_ready = std::async(std::launch::async, [] {
+        StartupShaders sh;
+        sh.vertex = readFile("Sample_GL.vert");
+        sh.fragment = readFile("Sample_GL.frag");
+        return sh;
+    });
+}
+
+/* Uniform grid over the x/z play area, used to find the tiles near the player.
+   Tiles are bucketed by their centre (obs.x,obs.z), items[cell_start[c] .. cell_start[c+1]) are the tiles of cell c */
+struct TileGrid {
+    float minx, minz;
+    float cell;
+    int nx, nz;
+    vector<int> cell_start;
+    vector<int> items;
+};
+TileGrid tile_grid;
+bool tile_grid_dirty = true; // set whenever tiles are added or moved in x/z
+int tile_grid_version = 0;   // bumped by every rebuild, snapshots copy the grid only when it changed
+const float collide_margin = 0.095f; // half size of the player/tile overlap test
+
+/* Re-bucket tiles 0..num_obs-1, a counting sort so each cell's tiles end up contiguous */
+void build_tile_grid ()
+{
+    TileGrid& g = tile_grid;
+    g.cell = 0.2f; // at least twice the margin, a query then touches 2x2 cells at most
+    g.minx = g.minz = 0;
+    float maxx = 0, maxz = 0;
+    for (int r=0; r<num_obs; r++) {
+        if (r==0 || obs.x[r]<g.minx) g.minx = obs.x[r];
+        if (r==0 || obs.z[r]<g.minz) g.minz = obs.z[r];
+        if (r==0 || obs.x[r]>maxx) maxx = obs.x[r];
+        if (r==0 || obs.z[r]>maxz) maxz = obs.z[r];
+    }
+    g.nx = (int)((maxx-g.minx)/g.cell) + 1;
+    g.nz = (int)((maxz-g.minz)/g.cell) + 1;
+
+    g.cell_start.assign(g.nx*g.nz + 1, 0);
+    g.items.resize(num_obs);
+    vector<int> cell_of(num_obs);
+    for (int r=0; r<num_obs; r++) {
+        int cx = min((int)((obs.x[r]-g.minx)/g.cell), g.nx-1);
+        int cz = min((int)((obs.z[r]-g.minz)/g.cell), g.nz-1);
+        cell_of[r] = cz*g.nx + cx;
+        g.cell_start[cell_of[r]+1]++;
+    }
+    for (int c=0; c<g.nx*g.nz; c++)
+        g.cell_start[c+1] += g.cell_start[c];
+    vector<int> fill(g.cell_start.begin(), g.cell_start.end()-1);
+    for (int r=0; r<num_obs; r++)
+        g.items[fill[cell_of[r]]++] = r;
+
+    tile_grid_dirty = false;
+    tile_grid_version++;
+}
+
+/* Time of impact, in [0,1], of a point moving from (x0,z0) to (x1,z1) with the square of half size
+   'margin' around (bx,bz), -1 if it misses. Slab test : the point is in the square while it is between
+   the square's sides on both axes, the first moment that holds is the impact */
+float sweepSquare (float x0, float z0, float x1, float z1, float bx, float bz, float margin)
+{
+    float start[2] = { x0-bx, z0-bz }, delta[2] = { x1-x0, z1-z0 };
+    float t0 = 0, t1 = 1;
+    for (int axis=0; axis<2; axis++) {
+        if (delta[axis] == 0) {
+            if (fabs(start[axis]) > margin)
+                return -1;
+            continue;
+        }
+        float ta = (-margin-start[axis])/delta[axis], tb = (margin-start[axis])/delta[axis];
+        if (ta > tb)
+            swap(ta, tb);
+        t0 = max(t0, ta);
+        t1 = min(t1, tb);
+        if (t0 > t1)
+            return -1;
+    }
+    return t0;
+}
+
+/* First visible tile the player runs into on the way from (x0,z0) to (x1,z1), its height going from jump0
+   to jump1; -1 if none, else 'toi' is how far along the way it was hit. The grid is walked a column
+   of cells at a time along the longer axis, each column only down to the cells the path can reach
+   there, so the cost follows the length of the path and not the size of its bounding box */
+int sweepTiles (float x0, float z0, float jump0, float x1, float z1, float jump1, float& toi)
+{
+    const TileGrid& g = tile_grid;
+    float reach = collide_margin + 0.001f; // a little slack so rounding never drops a boundary cell
+    bool along_x = fabs(x1-x0) >= fabs(z1-z0);
+    float a0 = along_x ? x0 : z0, a1 = along_x ? x1 : z1;  // the longer axis
+    float b0 = along_x ? z0 : x0, b1 = along_x ? z1 : x1;
+    float amin = along_x ? g.minx : g.minz, bmin = along_x ? g.minz : g.minx;
+    int na = along_x ? g.nx : g.nz, nb = along_x ? g.nz : g.nx;
+
+    int ca0 = max((int)floor((min(a0,a1)-reach-amin)/g.cell), 0);
+    int ca1 = min((int)floor((max(a0,a1)+reach-amin)/g.cell), na-1);
+    int hit = -1;
+    toi = 2;
+    for (int ca=ca0; ca<=ca1; ca++) {
+        // the stretch of the path within reach of this column, and the cells across it that stretch touches
+        float blo = min(b0,b1), bhi = max(b0,b1);
+        if (a1 != a0) {
+            float ta = (amin + ca*g.cell - reach - a0)/(a1-a0), tb = (amin + (ca+1)*g.cell + reach - a0)/(a1-a0);
+            if (ta > tb)
+                swap(ta, tb);
+            ta = max(ta, 0.0f);
+            tb = min(tb, 1.0f);
+            if (ta > tb)
+                continue;
+            blo = min(b0 + (b1-b0)*ta, b0 + (b1-b0)*tb);
+            bhi = max(b0 + (b1-b0)*ta, b0 + (b1-b0)*tb);
+        }
+        int cb0 = max((int)floor((blo-reach-bmin)/g.cell), 0);
+        int cb1 = min((int)floor((bhi+reach-bmin)/g.cell), nb-1);
+
+        for (int cb=cb0; cb<=cb1; cb++) {
+            int c = along_x ? cb*g.nx + ca : ca*g.nx + cb;
+            for (int k=g.cell_start[c]; k<g.cell_start[c+1]; k++) {
+                int r = g.items[k];
+                if (obs.visibility[r] >= appear_time*2/3)
+                    continue;
+                float t = sweepSquare(x0, z0, x1, z1, obs.x[r], obs.z[r], collide_margin);
+                if (t < 0 || t >= toi)
+                    continue;
+                float j = jump0 + (jump1-jump0)*t; // high enough over the tile at that moment clears it
+                if ((botpos[2]-0.09f+j)-(botpos[2]-0.12f+obs.mov[r])<0.5) {
+                    toi = t;
+                    hit = r;
+                }
+            }
         }
     }
+    return hit;
+}
+
+void fall_down(){
+    if (tile_grid_dirty)
+        build_tile_grid();
+
+    // the whole way since the last check, keys and jumps move the player in steps that
+    // grow with 'speed', at any speed a tile between two ticks is still in the way
+    float toi;
+    int hit = sweepTiles(botpos[1]+swept_posx, botpos[3]+swept_posz, swept_jump, botpos[1]+posx, botpos[3]+posz, jump, toi);
+    swept_posx = posx;
+    swept_posz = posz;
+    swept_jump = jump;
+    if (hit < 0)
+        return;
+
+    cout<<"You Lose!!"<<endl;
+    if (headless && !input_log.replaying && !input_log.record) {
+        // keep the benchmark going, start again from the corner
+        posx=prev_posx=swept_posx=0;
+        posz=prev_posz=swept_posz=0;
+        return;
+    }
+    quitGame();
 }
 
 void check_ground(){
@@ -1043,7 +3151,12 @@ void jump_func(){
 
 }
 
-void cameraposition(){
+void cameraposition(const CameraState& camera, float posx, float posz){
+    int campos = camera.campos;
+    float panx = camera.panx, panz = camera.panz;
+    float mouposx = camera.mouposx, mouposy = camera.mouposy;
+    float helcamx = camera.helcamx, helcamy = camera.helcamy;
+
     if(campos==0)
     {
       // tower view
@@ -1094,7 +3207,6 @@ void cameraposition(){
     else if(campos==4)
     {
       // helicopter view
-      helicopter = true;
       camfrom[1]= eyefrom[1]-panx + helcamx ;
       camfrom[2]= eyefrom[2] ;
       camfrom[3] = eyefrom[3]-panz + helcamy;
@@ -1107,16 +3219,16 @@ void cameraposition(){
 
 void checkdestination()
 {
-    if(posx>1.95 && posz>1.95){
+    if(!course_mode && posx>1.95 && posz>1.95){
         cout<<"Reached The destination"<<endl;
         cout<<"Yippe have now leveled up!!"<<endl;
         num_obs *=2;
-        posx=0;
-        posz=0;
+        spawn_obstacles(num_obs);
+        posx=prev_posx=swept_posx=0;
+        posz=prev_posz=swept_posz=0;
     }
 }
 
-int health = 5;
 void check_health(){
     if(jump_max>0.25 && jump_allow==true)
     {
@@ -1131,17 +3243,541 @@ void check_health(){
     }
 }
 
+const int tile_job_grain = 4096; // tiles per job, 16KB of each array, a multiple of job_align
+
+/* Advance the game by one simulation tick of 1/tick_rate seconds */
+void update_world ()
+{
+  ProfileScope profile(CPU_SIMULATION);
+  sim_tick++;
+
+  // keep the last state around, draw() interpolates between the two
+  prev_posx = posx;
+  prev_posz = posz;
+  prev_jump = jump;
+
+  { ProfileScope p(CPU_STREAMING); streamCourse(); }
+  { ProfileScope p(CPU_DESTINATION); checkdestination(); }
+  { ProfileScope p(CPU_HEALTH); check_health(); }
+
+  { ProfileScope p(CPU_JUMP); jump_func(); }
+  check_ground();
+  { ProfileScope p(CPU_COLLISION); fall_down(); }
+
+  tame += 0.001f;
+
+  //   some tiles appear disappear, the rest move up and down
+  {
+    ProfileScope p(CPU_TILE_UPDATE);
+    parallel_for(0, num_obs, tile_job_grain, [](int b, int e) {
+      memcpy(obs.prev_mov+b, obs.mov+b, (e-b)*sizeof(float));
+      update_obstacles(obs.mov+b, obs.dir+b, obs.visibility+b, obs.blink+b, e-b, appear_time);
+    });
+  }
+
+  // Increment angles
+  float increments = 1;
+
+  //camera_rotation_angle++; // Simulating camera rotation
+  triangle_rotation = triangle_rotation + increments*triangle_rot_dir*triangle_rot_status;
+  rectangle_rotation = rectangle_rotation + increments*rectangle_rot_dir*rectangle_rot_status;
+}
+
+/* Everything draw() needs from one tick. The simulation fills one of three snapshots while the
+   render thread draws the latest complete one, the two swap indices through one atomic and
+   never wait on each other */
+struct FrameSnapshot {
+    long tick;
+    double time;                           // when it was published
+    float posx, posz, jump;
+    float prev_posx, prev_posz, prev_jump; // the tick before, draw() blends the two
+    float triangle_rotation, rectangle_rotation;
+    bool flash, overlay;
+    double zoom;
+    CameraState camera;
+    int num_obs;
+    vector<float> x, z, mov, prev_mov;
+    vector<int> visibility;
+    TileGrid grid;
+    int grid_version;
+    double sim_ms[CPU_MATRICES];           // simulation phase times since the last snapshot
+};
+
+FrameSnapshot snapshots[3];
+const int snapshot_fresh = 4;          // set on snapshot_ready while the reader hasn't taken it
+int snapshot_back = 0;                 // simulation side
+int snapshot_front = 2;                // render side
+std::atomic<int> snapshot_ready(1);
+
+/* Copy the current state into the back snapshot and make it the latest */
+void publishSnapshot ()
+{
+    if (tile_grid_dirty)
+        build_tile_grid();
+
+    FrameSnapshot& s = snapshots[snapshot_back];
+    s.tick = sim_tick;
+    s.time = elapsed_seconds();
+    s.posx = posx; s.posz = posz; s.jump = jump;
+    s.prev_posx = prev_posx; s.prev_posz = prev_posz; s.prev_jump = prev_jump;
+    s.triangle_rotation = triangle_rotation;
+    s.rectangle_rotation = rectangle_rotation;
+    s.flash = flash;
+    s.overlay = profiler.overlay;
+    s.zoom = zoom;
+    CameraState camera = { campos, panx, panz, mouposx, mouposy, helcamx, helcamy };
+    s.camera = camera;
+    s.num_obs = num_obs;
+    s.x.assign(obs.x, obs.x+num_obs);
+    s.z.assign(obs.z, obs.z+num_obs);
+    s.mov.assign(obs.mov, obs.mov+num_obs);
+    s.prev_mov.assign(obs.prev_mov, obs.prev_mov+num_obs);
+    s.visibility.assign(obs.visibility, obs.visibility+num_obs);
+    if (s.grid_version != tile_grid_version) {
+        s.grid = tile_grid;
+        s.grid_version = tile_grid_version;
+    }
+    for (int p=0; p<CPU_MATRICES; p++) {
+        s.sim_ms[p] = profile_frame[p];
+        profile_frame[p] = 0;
+    }
+
+    snapshot_back = snapshot_ready.exchange(snapshot_back | snapshot_fresh) & 3;
+}
+
+/* The latest published snapshot, the same one again when nothing new came in */
+const FrameSnapshot& acquireSnapshot ()
+{
+    if (snapshot_ready.load() & snapshot_fresh)
+        snapshot_front = snapshot_ready.exchange(snapshot_front) & 3;
+    return snapshots[snapshot_front];
+}
+
+std::thread sim_thread;
+std::atomic<bool> sim_stop(false);
+
+/* Simulation thread : fixed ticks against the real clock, queued inputs applied before each tick */
+void simulationLoop ()
+{
+    profile_track = 3;
+    double dt = 1.0/tick_rate;
+    vector<InputEvent> inputs;
+    while (!sim_stop && !quit_requested) {
+        double now = elapsed_seconds();
+        sim_accumulator += now - last_frame_time;
+        last_frame_time = now;
+
+        int ticks = 0;
+        while (sim_accumulator >= dt && ticks < max_ticks_per_frame && !quit_requested) {
+            {
+                std::lock_guard<std::mutex> lock(input_mutex);
+                inputs.swap(input_queue);
+            }
+            for (size_t k=0; k<inputs.size(); k++)
+                dispatchInput(inputs[k].type, inputs[k].code, inputs[k].state, inputs[k].x, inputs[k].y);
+            inputs.clear();
+
+            update_world();
+            sim_accumulator -= dt;
+            ticks++;
+        }
+        if (ticks == max_ticks_per_frame && sim_accumulator >= dt)
+            sim_accumulator = 0; // too far behind, drop the backlog rather than slow down every later tick
+
+        if (ticks)
+            publishSnapshot();
+        else
+            std::this_thread::sleep_for(std::chrono::duration<double>(dt - sim_accumulator));
+    }
+}
+
+void stopSimulation ()
+{
+    sim_stop = true;
+    if (sim_thread.joinable())
+        sim_thread.join();
+    sim_threaded = false;
+}
+
+/* Publish the starting state, then hand the simulation to its own thread when 'threaded' */
+void startSimulation (bool threaded)
+{
+    publishSnapshot();
+    acquireSnapshot();
+    if (!threaded)
+        return;
+
+    sim_threaded = true;
+    last_frame_time = elapsed_seconds();
+    sim_thread = std::thread(simulationLoop);
+    atexit (stopSimulation); // runs before the handlers registered earlier, the thread is gone by then
+}
+
+/* View frustum as 6 planes (a,b,c,d), a point p is inside a plane when a*p.x+b*p.y+c*p.z+d >= 0 */
+struct Frustum {
+    glm::vec4 planes[6];
+};
+
+/* Planes of the clip volume of 'm' (Gribb/Hartmann), for m = projection * view they are in world space */
+Frustum extractFrustum (const glm::mat4& m)
+{
+    Frustum f;
+    for (int i=0; i<3; i++)
+    for (int side=0; side<2; side++) {
+        float sign = side ? -1.0f : 1.0f;
+        glm::vec4 plane;
+        for (int k=0; k<4; k++)
+            plane[k] = m[k][3] + sign*m[k][i]; // row 3 +- row i
+        float len = sqrt(plane[0]*plane[0] + plane[1]*plane[1] + plane[2]*plane[2]);
+        for (int k=0; k<4; k++)
+            plane[k] /= len;
+        f.planes[2*i + side] = plane;
+    }
+    return f;
+}
+
+enum { CULL_OUTSIDE, CULL_INTERSECTS, CULL_INSIDE };
+
+/* Where the axis aligned box lo..hi is relative to the frustum */
+int testBox (const Frustum& f, const glm::vec3& lo, const glm::vec3& hi)
+{
+    int result = CULL_INSIDE;
+    for (int i=0; i<6; i++) {
+        const glm::vec4& p = f.planes[i];
+        // the corner furthest along the plane normal, and the one furthest against it
+        float far_side = p[0]*(p[0]>=0 ? hi.x : lo.x) + p[1]*(p[1]>=0 ? hi.y : lo.y) + p[2]*(p[2]>=0 ? hi.z : lo.z) + p[3];
+        if (far_side < 0)
+            return CULL_OUTSIDE;
+        float near_side = p[0]*(p[0]>=0 ? lo.x : hi.x) + p[1]*(p[1]>=0 ? lo.y : hi.y) + p[2]*(p[2]>=0 ? lo.z : hi.z) + p[3];
+        if (near_side < 0)
+            result = CULL_INTERSECTS;
+    }
+    return result;
+}
+
+// tiles are +-0.05 cubes, their height offset stays within these bounds
+const float tile_half = 0.05f;
+const float tile_mov_min = -0.07f, tile_mov_max = 0.06f;
+
+/* Model matrix of tile r, its height blended by 'a' between the last two ticks */
+glm::mat4 tileModel (const FrameSnapshot& s, int r, float a)
+{
+    // rotate(180 about y) * translate(x, y, z) puts the tile at (-x, y, -z)
+    float rmov = s.prev_mov[r] + (s.mov[r]-s.prev_mov[r])*a;
+    glm::mat4 model(1.0f);
+    model[0][0] = -1;
+    model[2][2] = -1;
+    model[3] = glm::vec4(-s.x[r], botpos[2]-0.12f+rmov, -s.z[r], 1);
+    return model;
+}
+
+const int instance_job_grain = 2048;
+
+/* Render queue : one packet per object, sorted by key, each run of one mesh is one instanced draw */
+struct RenderPacket {
+    uint64_t key;
+    int model; // index into render_queue.models
+    int pad;
+};
+
+/* A run of sorted packets with the same key but for depth */
+struct RenderBatch {
+    uint64_t key; // depth bits cleared
+    int first, count;
+};
+
+struct RenderQueue {
+    vector<RenderPacket> packets, scratch;
+    vector<glm::mat4> models;
+    int count;
+    vector<RenderBatch> batches;
+} render_queue;
+
+// glMultiDrawArraysIndirect's and glMultiDrawElementsIndirect's command layouts
+struct DrawArraysIndirectCommand {
+    GLuint count, instanceCount, first, baseInstance;
+};
+struct DrawElementsIndirectCommand {
+    GLuint count, instanceCount, firstIndex;
+    GLint baseVertex;
+    GLuint baseInstance;
+};
+bool multi_draw = false; // the whole queue goes out in one glMultiDrawArraysIndirect per pass
+
+const float render_depth_range = 500.0f; // the far plane, depths beyond it share the last key
+
+/* Key of a packet, top bit first : pass (4 bits), program (12), fill mode (2), mesh (16), depth (30) */
+uint64_t renderKey (int pass, GLuint program, const VAO* mesh, float depth)
+{
+    uint64_t fill = mesh->FillMode == GL_LINE ? 1 : mesh->FillMode == GL_POINT ? 2 : 0;
+    uint64_t d = (uint64_t)(min(max(depth/render_depth_range, 0.0f), 1.0f) * ((1<<30) - 1));
+    return (uint64_t)pass << 60 | (uint64_t)(program & 0xfff) << 48 | fill << 46 | (uint64_t)(mesh->MeshId & 0xffff) << 30 | d;
+}
+
+/* Room for n more packets, returns the first one's index */
+int queuePackets (int n)
+{
+    RenderQueue& q = render_queue;
+    int first = q.count;
+    q.count += n;
+    if ((int)q.packets.size() < q.count) {
+        q.packets.resize(q.count);
+        q.models.resize(q.count);
+    }
+    return first;
+}
+
+void setPacket (int p, int pass, const VAO* mesh, const glm::mat4& VP, const glm::mat4& model)
+{
+    float depth = VP[0][3]*model[3][0] + VP[1][3]*model[3][1] + VP[2][3]*model[3][2] + VP[3][3]; // clip w of the origin
+    render_queue.packets[p].key = renderKey(pass, programID, mesh, depth);
+    render_queue.packets[p].model = p;
+    glm::mat4& m = render_queue.models[p];
+    m = model;
+    if (mesh->Format == VERTEX_PACKED) {
+        // model * translate(bias) * scale(scale) : the stored -1..1 positions back to the mesh's own
+        const glm::vec3& b = mesh->PositionBias;
+        const glm::vec3& s = mesh->PositionScale;
+        m[3] = m[0]*b.x + m[1]*b.y + m[2]*b.z + m[3];
+        m[0] = m[0]*s.x;
+        m[1] = m[1]*s.y;
+        m[2] = m[2]*s.z;
+    }
+}
+
+/* Queue 'mesh' drawn with 'model' */
+void submitDraw (int pass, const VAO* mesh, const glm::mat4& VP, const glm::mat4& model)
+{
+    setPacket(queuePackets(1), pass, mesh, VP, model);
+}
+
+/* LSD radix sort of the packets, a byte of the key per pass */
+void sortRenderQueue ()
+{
+    RenderQueue& q = render_queue;
+    q.scratch.resize(q.packets.size());
+    RenderPacket* from = &q.packets[0];
+    RenderPacket* to = &q.scratch[0];
+    for (int shift=0; shift<64 && q.count>1; shift+=8) {
+        int start[257] = {};
+        for (int k=0; k<q.count; k++)
+            start[((from[k].key >> shift) & 0xff) + 1]++;
+        if (start[((from[0].key >> shift) & 0xff) + 1] == q.count)
+            continue; // every key has this byte, as most top bytes do
+        for (int b=0; b<256; b++)
+            start[b+1] += start[b];
+        for (int k=0; k<q.count; k++)
+            to[start[(from[k].key >> shift) & 0xff]++] = from[k];
+        swap(from, to);
+    }
+    if (from != &q.packets[0])
+        q.packets.swap(q.scratch);
+}
+
+/* Copy the models into 'out' in draw order, the ring block the shader reads them from */
+void writeRenderModels (glm::mat4* out, int first, int count)
+{
+    parallel_for(first, first+count, instance_job_grain, [out, first](int b, int e) {
+        for (int k=b; k<e; k++)
+            out[k-first] = render_queue.models[render_queue.packets[k].model];
+    });
+}
+
+/* Group the sorted packets into batches, runs that share everything but depth. Each is one instanced draw */
+void buildRenderBatches ()
+{
+    RenderQueue& q = render_queue;
+    const uint64_t batch_mask = ~(((uint64_t)1 << 30) - 1);
+    q.batches.clear();
+    for (int k=0; k<q.count; ) {
+        RenderBatch batch = { q.packets[k].key & batch_mask, k, 1 };
+        while (k+batch.count < q.count && (q.packets[k+batch.count].key & batch_mask) == batch.key)
+            batch.count++;
+        q.batches.push_back(batch);
+        k += batch.count;
+    }
+}
+
+/* Ring space the indirect commands of 'batches' may take */
+GLsizeiptr renderCommandBytes (size_t batches)
+{
+    return multi_draw ? batches*(sizeof(DrawElementsIndirectCommand) + 64) : 0;
+}
+
+/* Cut the batches where they cross a multiple of 'window' packets */
+void splitRenderBatches (int window)
+{
+    RenderQueue& q = render_queue;
+    vector<RenderBatch> split;
+    for (size_t b=0; b<q.batches.size(); b++) {
+        RenderBatch batch = q.batches[b];
+        while (batch.first/window != (batch.first+batch.count-1)/window) {
+            RenderBatch head = batch;
+            head.count = (batch.first/window + 1)*window - batch.first;
+            split.push_back(head);
+            batch.first += head.count;
+            batch.count -= head.count;
+        }
+        split.push_back(batch);
+    }
+    q.batches.swap(split);
+}
+
+const VAO* batchMesh (const RenderBatch& batch)
+{
+    return render_meshes[(batch.key >> 30) & 0xffff];
+}
+
+/* Draw batches [b, end) with as few multi draw indirect calls as their state allows */
+void drawBatchesIndirect (size_t b, size_t end, int first_packet, int model_base)
+{
+    const RenderQueue& q = render_queue;
+    reserveInstanceIds (q.count);
+    while (b < end) {
+        const VAO* mesh = batchMesh(q.batches[b]);
+        uint64_t program = (q.batches[b].key >> 48) & 0xfff;
+        size_t e = b+1;
+        for (; e < end; e++) {
+            const VAO* next = batchMesh(q.batches[e]);
+            if (((q.batches[e].key >> 48) & 0xfff) != program || next->FillMode != mesh->FillMode ||
+                next->VertexArrayID != mesh->VertexArrayID || next->PrimitiveMode != mesh->PrimitiveMode ||
+                (next->NumIndices != 0) != (mesh->NumIndices != 0))
+                break;
+        }
+
+        bool indexed = mesh->NumIndices != 0;
+        GLintptr offset;
+        GLsizeiptr bytes = (e-b)*(indexed ? sizeof(DrawElementsIndirectCommand) : sizeof(DrawArraysIndirectCommand));
+        void* commands = ring_alloc(bytes, &offset);
+        for (size_t k=b; k<e; k++) {
+            const VAO* m = batchMesh(q.batches[k]);
+            if (indexed) {
+                DrawElementsIndirectCommand command = { (GLuint)m->NumIndices, (GLuint)q.batches[k].count, (GLuint)m->FirstIndex, m->FirstVertex, (GLuint)(q.batches[k].first - first_packet) };
+                ((DrawElementsIndirectCommand*)commands)[k-b] = command;
+            }
+            else {
+                DrawArraysIndirectCommand command = { (GLuint)m->NumVertices, (GLuint)q.batches[k].count, (GLuint)m->FirstVertex, (GLuint)(q.batches[k].first - first_packet) };
+                ((DrawArraysIndirectCommand*)commands)[k-b] = command;
+            }
+            frame_triangles += meshTriangles(m)*q.batches[k].count;
+        }
+        ring_commit(offset, commands, bytes);
+
+        useProgram (program);
+        setPolygonMode (mesh->FillMode);
+        bindVertexArray (mesh->VertexArrayID);
+        enableAttrib(0);
+        enableAttrib(1);
+        enableAttrib(2);
+        setModelBase (model_base);
+        glBindBuffer (GL_DRAW_INDIRECT_BUFFER, ring.Buffer);
+        frame_draw_calls++;
+        if (indexed)
+            glMultiDrawElementsIndirect (mesh->PrimitiveMode, GL_UNSIGNED_SHORT, (void*)offset, e-b, 0);
+        else
+            glMultiDrawArraysIndirect (mesh->PrimitiveMode, (void*)offset, e-b, 0);
+        b = e;
+    }
+}
+
+/* Draw batches [first, last) of the sorted queue, packet first_packet + k's model at 'model_base' + k */
+void drawRenderQueue (size_t first, size_t last, int first_packet, int model_base)
+{
+    const RenderQueue& q = render_queue;
+    for (size_t b=first; b<last; ) {
+        // a pass is timed as a whole, it ends any multi draw
+        int pass = q.batches[b].key >> 60;
+        size_t end = b+1;
+        while (end < last && (int)(q.batches[end].key >> 60) == pass)
+            end++;
+        GpuScope gpu((GpuPhase)pass);
+        if (multi_draw)
+            drawBatchesIndirect(b, end, first_packet, model_base);
+        else {
+            for (size_t k=b; k<end; k++) {
+                useProgram((q.batches[k].key >> 48) & 0xfff);
+                draw3DObjectInstanced((VAO*)batchMesh(q.batches[k]), model_base + q.batches[k].first - first_packet, q.batches[k].count);
+            }
+        }
+        b = end;
+    }
+}
+
+vector<int> tile_visible; // tiles that passed culling this frame
+
+// the per-frame model block : the identity, for the overlay, then the render queue's models
+const int model_identity = 0, model_queue = 1;
+const GLsizeiptr frame_ring_slack = 16384; // uniform blocks and the profile overlay
+
+/* Cull the tiles of grid cells [cx0,cx1) x [cz0,cz1) against the frustum, a region is tested as a whole
+   before it is split in four, so large parts of the course are accepted or rejected with one test.
+   The tiles that survive are appended to tile_visible, or counted in frame_tiles_hidden when blinked out */
+void cullTileRegion (const FrameSnapshot& s, const Frustum& f, int cx0, int cz0, int cx1, int cz1, bool inside)
+{
+    const TileGrid& g = s.grid;
+    if (!inside) {
+        // world space bounds of every tile bucketed in the region
+        float ylo = botpos[2]-0.12f+tile_mov_min-tile_half, yhi = botpos[2]-0.12f+tile_mov_max+tile_half;
+        glm::vec3 lo(-(g.minx+cx1*g.cell)-tile_half, ylo, -(g.minz+cz1*g.cell)-tile_half);
+        glm::vec3 hi(-(g.minx+cx0*g.cell)+tile_half, yhi, -(g.minz+cz0*g.cell)+tile_half);
+        int result = testBox(f, lo, hi);
+        if (result == CULL_OUTSIDE)
+            return;
+        inside = (result == CULL_INSIDE);
+    }
+
+    if (cx1-cx0 == 1 && cz1-cz0 == 1) {
+        int c = cz0*g.nx + cx0;
+        for (int k=g.cell_start[c]; k<g.cell_start[c+1]; k++) {
+            int r = g.items[k];
+            if (!inside) {
+                float y = botpos[2]-0.12f;
+                glm::vec3 lo(-s.x[r]-tile_half, y+tile_mov_min-tile_half, -s.z[r]-tile_half);
+                glm::vec3 hi(-s.x[r]+tile_half, y+tile_mov_max+tile_half, -s.z[r]+tile_half);
+                if (testBox(f, lo, hi) == CULL_OUTSIDE)
+                    continue;
+            }
+            if (s.visibility[r] >= appear_time*2/3)
+                frame_tiles_hidden++;
+            else
+                tile_visible.push_back(r);
+        }
+        return;
+    }
+
+    int mx = (cx0+cx1+1)/2, mz = (cz0+cz1+1)/2;
+    cullTileRegion(s, f, cx0, cz0, mx, mz, inside);
+    if (mx < cx1)
+        cullTileRegion(s, f, mx, cz0, cx1, mz, inside);
+    if (mz < cz1)
+        cullTileRegion(s, f, cx0, mz, mx, cz1, inside);
+    if (mx < cx1 && mz < cz1)
+        cullTileRegion(s, f, mx, mz, cx1, cz1, inside);
+}
+
 void draw ()
 {
-  // clear the color and depth in the frame buffer
-  checkdestination();
-  check_health();
+  // draw() only sees the game through the latest snapshot, the simulation may be mid-tick
+  const FrameSnapshot& s = acquireSnapshot();
+
+  // state blended between the last two ticks
+  float a = sim_threaded ? (float)min(1.0, (elapsed_seconds()-s.time)*tick_rate) : 1; // replays and --headless draw each tick as it ends
+  float rposx = s.prev_posx + (s.posx-s.prev_posx)*a;
+  float rposz = s.prev_posz + (s.posz-s.prev_posz)*a;
+  float rjump = s.prev_jump + (s.jump-s.prev_jump)*a;
+
+  if (s.zoom != view_zoom) {
+    view_zoom = s.zoom;
+    reshapeWindow(600,600);
+  }
 
-  glClear (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+  frame_draw_calls = 0;
+  frame_triangles = 0;
+  frame_redundant_calls = 0;
 
-  // use the loaded shader program
-  // Don't change unless you know what you are doing
-  glUseProgram (programID);
+  glm::mat4 VP, ground_model, bot_model, canon_model;
+  {
+  ProfileScope profile(CPU_MATRICES);
 
   // Eye - Location of camera. Don't change unless you are sure!!
   glm::vec3 eye ( 5*cos(camera_rotation_angle*M_PI/180.0f), 0, 5*sin(camera_rotation_angle*M_PI/180.0f) );
@@ -1154,19 +3790,16 @@ void draw ()
   // Matrices.view = glm::lookAt( eye, target, up ); // Rotating Camera for 3D
   //  Don't change unless you are sure!!
 
-  cameraposition();
+  cameraposition(s.camera, rposx, rposz);
 
   // TO-DO = camera roattion with bot rotation , for man's eye
   Matrices.view = glm::lookAt(glm::vec3(camfrom[1],camfrom[2],camfrom[3]), glm::vec3(camlook[1],camlook[2],camlook[3]), glm::vec3(0,1,0)); // Fixed camera for 2D (ortho) in XY plane
 
   // Compute ViewProject matrix as view/camera might not beappear changed for this frame (basic scenario)
   //  Don't change unless you are sure!!
-  glm::mat4 VP = Matrices.projection * Matrices.view;
+  VP = Matrices.projection * Matrices.view;
 
-  // Send our transformation to the currently bound shader, in the "MVP" uniform
-  // For each model you render, since the MVP will be different (at least the M part)
-  //  Don't change unless you are sure!!
-  glm::mat4 MVP;	// MVP = Projection * View * Model
+  // MVP is computed in the vertex shader, from the Frame block's VP and a model of the Models buffer
 
   // Load identity to model matrix
   Matrices.model = glm::mat4(1.0f);
@@ -1174,105 +3807,168 @@ void draw ()
   /* Render your scene */
 
   glm::mat4 translateTriangle = glm::translate (glm::vec3(0, -0.03f, 0.0f)); // glTranslatef
-  glm::mat4 rotateTriangle = glm::rotate((float)(triangle_rotation*M_PI/180.0f), glm::vec3(0,0,1));  // rotate about vector (1,0,0)
+  glm::mat4 rotateTriangle = glm::rotate((float)(s.triangle_rotation*M_PI/180.0f), glm::vec3(0,0,1));  // rotate about vector (1,0,0)
   glm::mat4 triangleTransform = rotateTriangle * translateTriangle;
   Matrices.model *= triangleTransform;
-  MVP = VP * Matrices.model; // MVP = p * V * M
-
-  //  Don't change unless you are sure!!
-  glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-
-  // draw3DObject draws the VAO given to it using current MVP matrix
-  draw3DObject(triangle);
-
-  jump_func();
-  check_ground();
-  fall_down();
-
+  ground_model = Matrices.model;
 
   Matrices.model = glm::mat4(1.0f);
   // bot
-  glm::mat4 translateRectangle = glm::translate (glm::vec3(botpos[1],botpos[2]-0.09f+jump,botpos[3]));        // glTranslatef
-  glm::mat4 rotateRectangle = glm::rotate((float)(rectangle_rotation*M_PI/180.0f), glm::vec3(0,1,0)); // rotate about vector (-1,1,1)
+  glm::mat4 translateRectangle = glm::translate (glm::vec3(botpos[1],botpos[2]-0.09f+rjump,botpos[3]));        // glTranslatef
+  glm::mat4 rotateRectangle = glm::rotate((float)(s.rectangle_rotation*M_PI/180.0f), glm::vec3(0,1,0)); // rotate about vector (-1,1,1)
   Matrices.model *= ( rotateRectangle *   translateRectangle  );
-  glm::mat4 translateRectangle2 = glm::translate (glm::vec3(posx,0,posz));        // glTranslatef
+  glm::mat4 translateRectangle2 = glm::translate (glm::vec3(rposx,0,rposz));        // glTranslatef
   // glm::mat4 rotateRectangle = glm::rotate((float)(rectangle_rotation*M_PI/180.0f), glm::vec3(0,1,0)); // rotate about vector (-1,1,1)
   Matrices.model *= (  translateRectangle2 );
-  MVP = VP * Matrices.model;
-  glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-
-  // draw3DObject draws the VAO given to it using current MVP matrix
-
-
-  tame += 0.001f;
-  draw3DObject(rectangle);
-
-
-  glm::mat4 translateobstacle[num_obs+1],obstacle_rotation[num_obs+1],rotateobstacle[num_obs+1];
-  for(int r=1;r<=num_obs;r++)
-  {
-      Matrices.model = glm::mat4(1.0f);
-
-    //   some tiles appear disappear
-    if(appear[r]%(num_obs/2)==0){
-        visibility[r]++;
-        if(visibility[r]>appear_time)
-            visibility[r]=1;
-    }
-    else{
-    if(mov[r]>0.05 || mov[r]<-0.06 ){
-        dir[r]*=-1;
-    }
-        mov[r]+=0.001*dir[r];
-    }
-      translateobstacle[r] = glm::translate (glm::vec3(obsx[r],botpos[2]-0.12f+mov[r],obsz[r]));        // glTranslatef
-      rotateobstacle[r] = glm::rotate((float)(180*M_PI/180.0f), glm::vec3(0,1,0)); // rotate about vector (-1,1,1)
-      Matrices.model *= (rotateobstacle[r]*translateobstacle[r] );
-      MVP = VP * Matrices.model;
-      glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-
-      // draw3DObject draws the VAO given to it using current MVP matrix
-      if(visibility[r]<(appear_time*2/3))
-      draw3DObject(obstacle[r]);
-
-    //   obstacle_rotation[r] = obstacle_rotation[r] + obstacle_rot_dir[r]*obstacle_rot_status[r];
-
-  }
+  bot_model = Matrices.model;
 
   // canon
   Matrices.model = glm::mat4(1.0f);
 
-  glm::mat4 translatecanon = glm::translate (glm::vec3(botpos[1]+posx,botpos[2]-0.09f+0.04f+jump,botpos[3]+posz));        // glTranslatef
+  glm::mat4 translatecanon = glm::translate (glm::vec3(botpos[1]+rposx,botpos[2]-0.09f+0.04f+rjump,botpos[3]+rposz));        // glTranslatef
   glm::mat4 rotatecanon = glm::rotate((float)((180)*M_PI/180.0f), glm::vec3(0,1,0)); // rotate about vector (0,0,1)
   glm::mat4 rotatecanon2 = glm::rotate((float)((90)*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (0,0,1)
   glm::mat4 rotatecanon3 = glm::rotate((float)((90)*M_PI/180.0f), glm::vec3(0,1,0)); // rotate about vector (0,0,1)
   Matrices.model *= (rotatecanon * translatecanon * rotatecanon * rotatecanon2 * rotatecanon3);
-  MVP = VP * Matrices.model;
-  glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
+  canon_model = Matrices.model;
+  }
 
-  // draw3DObject draws the VAO given to it using current MVP matrix
-  if(flash==true)
-  draw3DObject(canon);
+  {
+  // only the tiles inside the view frustum are sent to the GPU
+  ProfileScope profile(CPU_CULLING);
+  tile_visible.clear();
+  frame_tiles_hidden = 0;
+  cullTileRegion(s, extractFrustum(VP), 0, 0, s.grid.nx, s.grid.nz, false);
+  frame_tiles_drawn = tile_visible.size();
+  frame_tiles_culled = s.num_obs - frame_tiles_drawn - frame_tiles_hidden;
+  }
 
-  // Swap the frame buffers
-  glutSwapBuffers ();
+  {
+  ProfileScope profile(CPU_SUBMIT);
+
+  // the scene, as render queue packets
+  if (course_mode) {
+    // tiles at course position (x,z) are drawn at (-x,-z), so are the chunks' boards
+    int pcx = courseChunkOf(botpos[1]+rposx), pcz = courseChunkOf(botpos[3]+rposz);
+    for (int g=0; g<9; g++)
+      submitDraw(GPU_GROUND_BOT, triangle, VP, glm::translate(glm::vec3(-(pcx + g%3 - 1)*chunk_size, 0, -(pcz + g/3 - 1)*chunk_size)) * ground_model);
+  }
+  else
+    submitDraw(GPU_GROUND_BOT, triangle, VP, ground_model);
+  submitDraw(GPU_GROUND_BOT, rectangle, VP, bot_model);
+  int first_tile = queuePackets(frame_tiles_drawn);
+  parallel_for(0, frame_tiles_drawn, instance_job_grain, [&](int b, int e) {
+    for (int k=b; k<e; k++) {
+      int r = tile_visible[k];
+      glm::vec3 centre(-s.x[r], botpos[2]-0.12f+s.mov[r], -s.z[r]);
+      const VAO* mesh = obstacle_lods.lod[pickLod(obstacle_lods, projectedPixels(VP, centre, obstacle_lods.radius))];
+      setPacket(first_tile + k, GPU_TILES, mesh, VP, tileModel(s, r, a));
+    }
+  });
+  if(s.flash==true) {
+    float pixels = projectedPixels(VP, glm::vec3(canon_model[3][0], canon_model[3][1], canon_model[3][2]), canon_lods.radius);
+    submitDraw(GPU_HEADLIGHT, canon_lods.lod[pickLod(canon_lods, pixels)], VP, canon_model);
+  }
+  sortRenderQueue();
+  buildRenderBatches();
+
+  // the whole queue in one go when its models fit in a region, else in windows of packets that do
+  RenderQueue& q = render_queue;
+  const GLsizeiptr packet_bytes = sizeof(glm::mat4) + renderCommandBytes(1);
+  int window = q.count;
+  if ((model_queue + q.count)*sizeof(glm::mat4) + renderCommandBytes(q.batches.size()) + frame_ring_slack > (size_t)ringMaxRegion()) {
+    window = max(1, (int)((ringMaxRegion() - frame_ring_slack)/packet_bytes) - model_queue);
+    splitRenderBatches(window);
+  }
 
-  // Increment angles
-  float increments = 1;
+  // clear the color and depth in the frame buffer
+  glClear (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-  //camera_rotation_angle++; // Simulating camera rotation
-  triangle_rotation = triangle_rotation + increments*triangle_rot_dir*triangle_rot_status;
-  rectangle_rotation = rectangle_rotation + increments*rectangle_rot_dir*rectangle_rot_status;
+  // use the loaded shader program
+  // Don't change unless you know what you are doing
+  useProgram (programID);
+
+  int model_base = 0;
+  for (size_t b=0, w=0; b<q.batches.size() || w==0; w++) {
+    int first = w*window, count = min(window, q.count - first);
+    size_t end = b;
+    while (end < q.batches.size() && q.batches[end].first < first + count)
+      end++;
+
+    // the window's models in draw order, reserved with room for the small allocations after them
+    GLsizeiptr model_bytes = (model_queue + count)*sizeof(glm::mat4);
+    bool moved = ring_reserve(model_bytes + renderCommandBytes(end-b) + frame_ring_slack);
+    GLintptr models_offset;
+    glm::mat4* models = (glm::mat4*) ring_alloc(model_bytes, &models_offset);
+    model_base = models_offset/sizeof(glm::mat4);
+    models[model_identity] = glm::mat4(1.0f);
+    writeRenderModels(models + model_queue, first, count);
+    ring_commit(models_offset, models, model_bytes);
+
+    if (w == 0 || moved)
+      bindFrameBlock(VP); // the last one was left in another region or buffer
+    drawRenderQueue(b, end, first, model_base + model_queue);
+    b = end;
+  }
+  q.count = 0;
 
+  drawProfileOverlay(s.overlay, model_base + model_identity);
+
+  ring_end_frame();
+  }
+  profileEndFrame(s.sim_ms, s.overlay);
+
+  // Swap the frame buffers
+  if (!headless) {
+    glutSwapBuffers ();
+    pacingEndFrame ();
+  }
 }
 
 /* Executed when the program is idle (no I/O activity) */
+/* Replays step here : the log drives time, one tick per frame, at the ticks the inputs were recorded at */
+void replayFrame ()
+{
+    if (quit_requested || !replayInputs()) {
+        printf("Replay finished after %ld ticks, state hash %016llx\n", sim_tick, stateHash());
+        exit (0);
+    }
+    update_world();
+    publishSnapshot();
+    draw ();
+}
+
 void idle () {
-    // OpenGL should never stop drawing
+    if (quit_requested && !input_log.replaying)
+        exit (0);
+
+    paceFrame ();
+
+    if (input_log.replaying) {
+        replayFrame ();
+        return;
+    }
+
+    // OpenGL should never stop drawing, the simulation thread keeps the snapshots coming
     // can draw the same scene or a modified scene
     draw (); // drawing same scene
 }
 
+/* Power-save mode's replacement for idle(), runs at the tick rate (or --fps) and draws only new snapshots */
+void powerSaveTimer (int value)
+{
+    if (quit_requested && !input_log.replaying)
+        exit (0);
+
+    double interval = 1.0/(pacing.target_fps > 0 ? pacing.target_fps : tick_rate);
+    glutTimerFunc ((unsigned int)(interval*1000), powerSaveTimer, 0);
+
+    if (input_log.replaying)
+        replayFrame ();
+    else if (snapshot_ready.load() & snapshot_fresh)
+        draw ();
+}
+
 
 /* Initialise glut window, I/O callbacks and the renderer to use */
 /* Nothing to Edit here */
@@ -1297,23 +3993,173 @@ void initGLUT (int& argc, char** argv, int width, int height)
     }
 
     // register glut callbacks
-    glutKeyboardFunc (keyboardDown);
+    glutKeyboardFunc (onKeyboardDown);
     glutKeyboardUpFunc (keyboardUp);
 
-    glutSpecialFunc (keyboardSpecialDown);
+    glutSpecialFunc (onKeyboardSpecialDown);
     glutSpecialUpFunc (keyboardSpecialUp);
 
-    glutMouseFunc (mouseClick);
-    glutPassiveMotionFunc (mouseMotion);
+    glutMouseFunc (onMouseClick);
+    glutPassiveMotionFunc (onMouseMotion);
 
     glutReshapeFunc (reshapeWindow);
 
     glutDisplayFunc (draw); // function to draw when active
-    glutIdleFunc (idle); // function to draw when idle (no I/O activity)
+    if (pacing.power_save)
+        glutTimerFunc (0, powerSaveTimer, 0); // sleep in the event loop, wake up for the next tick
+    else
+        glutIdleFunc (idle); // function to draw when idle (no I/O activity)
 
     glutIgnoreKeyRepeat (true); // Ignore keys held down
 }
 
+/* Create a surfaceless EGL context and an offscreen framebuffer to render into, no window needed */
+void initHeadless (int width, int height)
+{
+    // Mesa's surfaceless platform works with no X server and no GPU (llvmpipe)
+    EGLDisplay display = EGL_NO_DISPLAY;
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (getPlatformDisplay)
+        display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    if (display == EGL_NO_DISPLAY)
+        display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+
+    EGLint major, minor;
+    if (display == EGL_NO_DISPLAY || !eglInitialize(display, &major, &minor)) {
+        cout << "Error: Failed to initialise EGL" << endl;
+        exit (1);
+    }
+    eglBindAPI(EGL_OPENGL_API);
+
+    // surfaceless displays may expose no configs at all, a context without one is fine then
+    EGLConfig config = (EGLConfig)0;
+    EGLint num_configs = 0;
+    const EGLint config_attribs[] = { EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE };
+    eglChooseConfig(display, config_attribs, &config, 1, &num_configs);
+    if (num_configs == 0)
+        config = (EGLConfig)0;
+
+    // Same GL 3.3 core context initGLUT asks for
+    const EGLint context_attribs[] = {
+        EGL_CONTEXT_MAJOR_VERSION, 3,
+        EGL_CONTEXT_MINOR_VERSION, 3,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+        EGL_NONE
+    };
+    EGLContext context = eglCreateContext(display, config, EGL_NO_CONTEXT, context_attribs);
+    if (context == EGL_NO_CONTEXT || !eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context)) {
+        cout << "Error: Failed to create a surfaceless GL 3.3 context" << endl;
+        exit (1);
+    }
+
+    // GLEW built for GLX reports a missing X display after it has loaded the entry points
+    glewExperimental = GL_TRUE;
+    GLenum err = glewInit();
+    if (err != GLEW_OK && err != GLEW_ERROR_NO_GLX_DISPLAY) {
+        cout << "Error: Failed to initialise GLEW : "<< glewGetErrorString(err) << endl;
+        exit (1);
+    }
+
+    // Offscreen framebuffer standing in for the window
+    GLuint color, depth;
+    glGenRenderbuffers (1, &color);
+    glBindRenderbuffer (GL_RENDERBUFFER, color);
+    glRenderbufferStorage (GL_RENDERBUFFER, GL_RGBA8, width, height);
+    glGenRenderbuffers (1, &depth);
+    glBindRenderbuffer (GL_RENDERBUFFER, depth);
+    glRenderbufferStorage (GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+
+    glGenFramebuffers (1, &headless_fbo);
+    glBindFramebuffer (GL_FRAMEBUFFER, headless_fbo);
+    glFramebufferRenderbuffer (GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, color);
+    glFramebufferRenderbuffer (GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depth);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        cout << "Error: Offscreen framebuffer is incomplete" << endl;
+        exit (1);
+    }
+}
+
+/* Keys pressed by the headless benchmark, the script repeats every bench_script_length frames */
+struct ScriptedKey {
+    int frame;
+    unsigned char key;
+};
+const ScriptedKey bench_script[] = {
+    {  0, 'f'}, { 10, 'w'}, { 20, 'w'}, { 30, 'a'}, { 40, 'a'}, { 50, 32},
+    {120, 13},  {130, 'w'}, {140, 'a'}, {150, 'c'}, {160, 32},
+    {240, 13},  {250, 'w'}, {260, 'v'}, {270, 32},  {280, 'v'},
+    {360, 13},  {370, 'a'}, {380, 'a'}, {390, 's'}, {400, 32},
+    {480, 13},  {490, 'w'}, {500, 'a'}, {510, 'f'}, {540, 13},
+};
+const int bench_script_length = 600;
+
+/* Value below which p percent of the sorted samples fall (nearest rank) */
+double percentile (const vector<double>& sorted, double p)
+{
+    if (sorted.empty())
+        return 0;
+    int rank = (int)ceil(p/100.0*sorted.size()) - 1;
+    return sorted[max(0, min(rank, (int)sorted.size()-1))];
+}
+
+/* Run 'frames' frames of scripted play offscreen (or a replay, to the end of its log) and report frame time statistics */
+void runHeadless (int frames)
+{
+    vector<double> frame_ms;
+    frame_ms.reserve(input_log.replaying ? input_log.events.size() : frames);
+    long total_calls = 0, total_triangles = 0, total_redundant = 0;
+    long total_drawn = 0, total_culled = 0, total_hidden = 0;
+    double cpu_total[CPU_PHASES] = {}, gpu_total[GPU_PHASES] = {};
+
+    for (int f=0; input_log.replaying || f<frames; f++) {
+        if (quit_requested)
+            break;
+        if (input_log.replaying) {
+            if (!replayInputs())
+                break;
+        }
+        else {
+            for (size_t k=0; k<sizeof(bench_script)/sizeof(bench_script[0]); k++)
+                if (bench_script[k].frame == f % bench_script_length)
+                    dispatchInput(INPUT_KEY, bench_script[k].key, 0, 0, 0);
+        }
+
+        double start = elapsed_seconds();
+        // exactly one tick per frame, so every box simulates the same run
+        update_world();
+        publishSnapshot();
+        draw();
+        glFinish(); // wait for the GPU, the sample has to cover the whole frame
+        frame_ms.push_back((elapsed_seconds() - start)*1000.0);
+
+        total_calls += frame_draw_calls;
+        total_triangles += frame_triangles;
+        total_redundant += frame_redundant_calls;
+        total_drawn += frame_tiles_drawn;
+        total_culled += frame_tiles_culled;
+        total_hidden += frame_tiles_hidden;
+        for (int p=0; p<CPU_PHASES; p++)
+            cpu_total[p] += profiler.cpu_ms[p];
+        for (int p=0; p<GPU_PHASES; p++)
+            gpu_total[p] += profiler.gpu_ms[p];
+    }
+
+    frames = frame_ms.size();
+    sort(frame_ms.begin(), frame_ms.end());
+    printf("frames: %d\n", frames);
+    printf("frame time (ms): p50 %.3f  p95 %.3f  p99 %.3f\n", percentile(frame_ms, 50), percentile(frame_ms, 95), percentile(frame_ms, 99));
+    printf("draw calls/frame: %.1f\n", frames ? (double)total_calls/frames : 0.0);
+    printf("triangles/frame: %.1f\n", frames ? (double)total_triangles/frames : 0.0);
+    printf("redundant GL calls skipped/frame: %.1f\n", frames ? (double)total_redundant/frames : 0.0);
+    printf("tiles drawn/culled per frame: %.1f / %.1f (%.1f more blinked out)\n", frames ? (double)total_drawn/frames : 0.0,
+           frames ? (double)total_culled/frames : 0.0, frames ? (double)total_hidden/frames : 0.0);
+    for (int p=0; p<CPU_PHASES; p++)
+        printf("  %-18s %.4f ms/frame\n", cpu_phase_names[p], cpu_total[p]/max(frames, 1));
+    for (int p=0; p<GPU_PHASES; p++)
+        printf("  %-18s %.4f ms/frame\n", gpu_phase_names[p], gpu_total[p]/max(frames, 1));
+    printf("ticks: %ld  state hash: %016llx\n", sim_tick, stateHash());
+}
+
 /* Process menu option 'op' */
 void menu(int op)
 {
@@ -1344,15 +4190,29 @@ void addGLUTMenus ()
 /* Add all the models to be created here */
 void initGL (int width, int height)
 {
+	// Every static mesh lives in one buffer, per-frame data in the stream ring
+	initVertexArena (1 << 16);
+	growStreamRing (1 << 16);
+
+	// Load barrier : the worker threads started by startAssetLoads have to be done
+	StartupMeshes meshes = meshes_ready.get();
+	StartupShaders shaders = shaders_ready.get();
+
 	// Create the models
-	createground (); // Generate the VAO, VBOs, vertices data & copy into the array buffer
-    createobstacle();
-    createcanon (0.2f,0); // pointed at -3   .5,-3
+	createground (meshes.ground); // Copy the vertices into the arena, set up the VAO
+    createobstacle(meshes.obstacle);
+    createcanon (meshes.canon);
 
 	// Create and compile our GLSL program from the shaders
-	programID = LoadShaders( "Sample_GL.vert", "Sample_GL.frag" );
+	programID = LoadShaders( "Sample_GL.vert", shaders.vertex, "Sample_GL.frag", shaders.fragment );
 	// Get a handle for our "MVP" uniform
-	Matrices.MatrixID = glGetUniformLocation(programID, "MVP");
+	ModelBaseID = glGetUniformLocation(programID, "ModelBase");
+	glUniformBlockBinding(programID, glGetUniformBlockIndex(programID, "Frame"), frame_block_binding);
+	useProgram(programID);
+	glUniform1i(glGetUniformLocation(programID, "Models"), 0); // ring.Texture, on unit 0
+	glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &uniform_align);
+	glVertexAttribI4i(2, 0, 0, 0, 0); // instance id of VAOs without the attribute, the profile overlay
+	multi_draw = GLEW_VERSION_4_3 || (GLEW_ARB_multi_draw_indirect && GLEW_ARB_base_instance);
 
 
 	reshapeWindow (width, height);
@@ -1364,7 +4224,9 @@ void initGL (int width, int height)
 	glEnable (GL_DEPTH_TEST);
 	glDepthFunc (GL_LEQUAL);
 
-	createbot ();
+	createbot (meshes.bot);
+
+	initProfiler ();
 
 	cout << "VENDOR: " << glGetString(GL_VENDOR) << endl;
 	cout << "RENDERER: " << glGetString(GL_RENDERER) << endl;
@@ -1377,16 +4239,87 @@ int main (int argc, char** argv)
 {
 	int width = 600;
 	int height = 600;
+    const char* record_path = NULL;
+    const char* replay_path = NULL;
+    const char* save_level_path = NULL;
+    int job_workers = max(0, (int)std::thread::hardware_concurrency() - 1);
+
+    for (int a=1; a<argc; a++) {
+        if (strcmp(argv[a], "--tick-rate") == 0 && a+1 < argc)
+            tick_rate = max(1, atoi(argv[++a]));
+        else if (strcmp(argv[a], "--headless") == 0)
+            headless = true;
+        else if (strcmp(argv[a], "--frames") == 0 && a+1 < argc)
+            bench_frames = max(1, atoi(argv[++a]));
+        else if (strcmp(argv[a], "--trace") == 0 && a+1 < argc)
+            profiler.trace_path = argv[++a];
+        else if (strcmp(argv[a], "--record") == 0 && a+1 < argc)
+            record_path = argv[++a];
+        else if (strcmp(argv[a], "--replay") == 0 && a+1 < argc)
+            replay_path = argv[++a];
+        else if (strcmp(argv[a], "--jobs") == 0 && a+1 < argc)
+            job_workers = max(0, atoi(argv[++a]));
+        else if (strcmp(argv[a], "--fps") == 0 && a+1 < argc)
+            pacing.target_fps = max(0, atoi(argv[++a]));
+        else if (strcmp(argv[a], "--vsync") == 0 && a+1 < argc)
+            pacing.swap_interval = max(0, atoi(argv[++a]));
+        else if (strcmp(argv[a], "--power-save") == 0)
+            pacing.power_save = true;
+        else if (strcmp(argv[a], "--course") == 0)
+            course_mode = true;
+        else if (strcmp(argv[a], "--level") == 0 && a+1 < argc)
+            level_path = argv[++a];
+        else if (strcmp(argv[a], "--save-level") == 0 && a+1 < argc)
+            save_level_path = argv[++a];
+        else if (strcmp(argv[a], "--tiles") == 0 && a+1 < argc)
+            num_obs = max(2, atoi(argv[++a]));
+        else if (strcmp(argv[a], "--self-test") == 0)
+            return selfTest();
+    }
+    if (replay_path)
+        startReplay(replay_path); // after the options, what the log says wins over them
+    if (save_level_path) {
+        // the level tool : lay out the first level as the game would and write it out
+        course_mode = false;
+        createlayout ();
+        saveLevel (save_level_path);
+        return 0;
+    }
 
-    initGLUT (argc, argv, width, height);
+    startJobs (job_workers);
+    if (record_path)
+        startRecording(record_path);
+    if (profiler.trace_path)
+        atexit (writeTrace); // the game leaves through exit() from several places
 
-    if(!buffer1.loadFromFile("Helicopter.wav"))
-        return -1;
-    sound1.setBuffer(buffer1);
+    if (course_mode)
+        startCourse ();
+
+    // decode audio and build meshes while the window and GL context come up
+    startAssetLoads (!headless);
+
+    if (headless) {
+        initHeadless (width, height);
+        initGL (width, height);
+        startSimulation (false);
+        runHeadless (bench_frames);
+        return 0;
+    }
+
+    initGLUT (argc, argv, width, height);
 
     addGLUTMenus ();
 
 	initGL (width, height);
+    initPacing ();
+    atexit (reportPacing);
+
+    if(!audio_ready.get())
+        return -1;
+    sound1.setBuffer(buffer1);
+
+    // a replay stays on this thread, it has to step in lockstep with the frames
+    startSimulation (!input_log.replaying);
 
     glutMainLoop ();
 